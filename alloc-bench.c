@@ -0,0 +1,145 @@
+/*
+ * Allocator throughput benchmark, remotethread heap versus glibc
+ *
+ * Usage: ./alloc-bench [operations]
+ */
+#include <remotethread.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define NUM_SLOTS		4096
+#define DEFAULT_OPS		2000000
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*realloc)(void *ptr, size_t size);
+};
+
+static void *rt_malloc(size_t size)
+{
+	return remotethread_malloc(size, NULL);
+}
+
+static void rt_free(void *ptr)
+{
+	remotethread_free(ptr, NULL);
+}
+
+static void *rt_realloc(void *ptr, size_t size)
+{
+	return remotethread_realloc(ptr, size, NULL);
+}
+
+static const struct allocator allocators[] = {
+	{"glibc", malloc, free, realloc},
+	{"remotethread", rt_malloc, rt_free, rt_realloc},
+};
+
+/* size distributions */
+enum {
+	DIST_SMALL,	/* 16..256 bytes */
+	DIST_MIXED,	/* mostly small, every 64th up to 64 KB */
+	DIST_LARGE,	/* 64 KB..1 MB */
+	NUM_DISTS,
+};
+
+static const char *const dist_names[NUM_DISTS] = {"small", "mixed", "large"};
+
+static uint32_t rand_state;
+
+static uint32_t next_rand(void)
+{
+	/* xorshift, so that both allocators see the same sequence */
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static size_t random_size(int dist)
+{
+	uint32_t r = next_rand();
+	switch (dist) {
+	case DIST_SMALL:
+		return 16 + r % 241;
+	case DIST_MIXED:
+		if (r % 64 == 0)
+			return 256 + (r >> 6) % (64 * 1024);
+		return 16 + (r >> 6) % 241;
+	default:
+		return 64 * 1024 + r % (960 * 1024);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Random mix of malloc (50%), free (30%) and realloc (20%) over a fixed
+ * number of live slots. Every block is touched once.
+ */
+static double run(const struct allocator *a, int dist, long ops)
+{
+	static char *slots[NUM_SLOTS];
+	long i;
+	for (i = 0; i < NUM_SLOTS; ++i)
+		slots[i] = NULL;
+	rand_state = 2463534242u;
+
+	double start = now();
+	for (i = 0; i < ops; ++i) {
+		uint32_t r = next_rand();
+		int slot = r % NUM_SLOTS;
+		int op = (r >> 16) % 10;
+		if (slots[slot] == NULL || op < 5) {
+			a->free(slots[slot]);
+			size_t size = random_size(dist);
+			slots[slot] = a->malloc(size);
+			slots[slot][0] = 1;
+		} else if (op < 8) {
+			a->free(slots[slot]);
+			slots[slot] = NULL;
+		} else {
+			size_t size = random_size(dist);
+			slots[slot] = a->realloc(slots[slot], size);
+			slots[slot][size - 1] = 1;
+		}
+	}
+	for (i = 0; i < NUM_SLOTS; ++i)
+		a->free(slots[i]);
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	if (init_remotethread(&argc, &argv))
+		return 1;
+
+	long ops = DEFAULT_OPS;
+	if (argc >= 2)
+		ops = atol(argv[1]);
+
+	printf("%-8s %-14s %12s %10s\n", "sizes", "allocator", "Mops/s",
+	       "ns/op");
+	int dist;
+	size_t i;
+	for (dist = 0; dist < NUM_DISTS; ++dist) {
+		long n = ops;
+		if (dist == DIST_LARGE)
+			n /= 20;
+		for (i = 0; i < sizeof allocators / sizeof allocators[0]; ++i) {
+			double t = run(&allocators[i], dist, n);
+			printf("%-8s %-14s %12.2f %10.1f\n", dist_names[dist],
+			       allocators[i].name, n / t * 1e-6, t / n * 1e9);
+		}
+	}
+	return 0;
+}
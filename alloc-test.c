@@ -3,9 +3,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 
 #define NUM_ALLOCS		100
 
+/* the bookkeeping between two blocks allocated back to back */
+static size_t block_overhead(void)
+{
+	char *a = remotethread_malloc(1, NULL);
+	char *b = remotethread_malloc(1, NULL);
+	size_t overhead = b - (a + remotethread_malloc_usable_size(a));
+	remotethread_free(b, NULL);
+	remotethread_free(a, NULL);
+	return overhead;
+}
+
 int main(int argc, char **argv)
 {
 	if (init_remotethread(&argc, &argv))
@@ -13,6 +25,9 @@ int main(int argc, char **argv)
 
 	srand(time(NULL));
 
+	/* an empty heap has no chunks */
+	remotethread_check_alloc();
+
 	int i;
 	int retry;
 	char *ptr[NUM_ALLOCS];
@@ -56,5 +71,76 @@ int main(int argc, char **argv)
 		remotethread_check_alloc();
 	}
 
+	for (i = 0; i < NUM_ALLOCS; ++i) {
+		size_t len = 256 + 64*i;
+		size_t align = (size_t) 16 << (i % 10);
+		if (i % 2) {
+			ptr[i] = remotethread_calloc(len, 1, NULL);
+			for (p = 0; p < len; ++p)
+				assert(ptr[i][p] == 0);
+		} else {
+			ptr[i] = remotethread_memalign(align, len, NULL);
+			assert(((size_t) ptr[i] & (align - 1)) == 0);
+		}
+		assert(remotethread_malloc_usable_size(ptr[i]) >= len);
+		memset(ptr[i], i, len);
+		remotethread_check_alloc();
+	}
+	for (i = 0; i < NUM_ALLOCS; ++i) {
+		size_t len = 256 + 64*i;
+		for (p = 0; p < len; ++p)
+			assert(ptr[i][p] == i);
+		remotethread_free(ptr[i], NULL);
+		remotethread_check_alloc();
+	}
+
+	/*
+	 * Small alignments leave either no chunk or a whole one in front of
+	 * the aligned chunk, whose end stays 64-byte aligned.
+	 */
+	size_t overhead = block_overhead();
+	for (i = 0; i < 3; ++i) {
+		size_t align = (size_t) 8 << i;
+		char *keep = remotethread_malloc(100, NULL);
+		char *keep_end = keep + remotethread_malloc_usable_size(keep);
+		ptr[0] = remotethread_memalign(align, 100, NULL);
+		assert(((size_t) ptr[0] & (align - 1)) == 0);
+		size_t gap = ptr[0] - keep_end - overhead;
+		assert(gap == 0 || gap >= 64);
+		memset(ptr[0], i, 100);
+		remotethread_check_alloc();
+		ptr[0] = remotethread_realloc(ptr[0], 50, NULL);
+		assert(((size_t) ptr[0] + remotethread_malloc_usable_size(ptr[0]))
+		       % 64 == 0);
+		remotethread_check_alloc();
+		ptr[0] = remotethread_realloc(ptr[0], 1000, NULL);
+		assert(((size_t) ptr[0] + remotethread_malloc_usable_size(ptr[0]))
+		       % 64 == 0);
+		remotethread_check_alloc();
+		for (p = 0; p < 50; ++p)
+			assert(ptr[0][p] == i);
+		remotethread_free(ptr[0], NULL);
+		remotethread_free(keep, NULL);
+		remotethread_check_alloc();
+	}
+
+	/* sizes that overflow */
+	errno = 0;
+	assert(remotethread_malloc((size_t) -1, NULL) == NULL);
+	assert(errno == ENOMEM);
+	errno = 0;
+	assert(remotethread_calloc(1, (size_t) -1 - 9, NULL) == NULL);
+	assert(errno == ENOMEM);
+	assert(remotethread_calloc((size_t) -1 / 2, 3, NULL) == NULL);
+	assert(remotethread_memalign(64, (size_t) -1 - 100, NULL) == NULL);
+	assert(remotethread_memalign((size_t) 1 << 63, 100, NULL) == NULL);
+	ptr[0] = remotethread_malloc(100, NULL);
+	memset(ptr[0], 1, 100);
+	assert(remotethread_realloc(ptr[0], (size_t) -1 - 9, NULL) == NULL);
+	for (p = 0; p < 100; ++p)
+		assert(ptr[0][p] == 1);
+	remotethread_free(ptr[0], NULL);
+	remotethread_check_alloc();
+
 	return 0;
 }
@@ -0,0 +1,234 @@
+/*
+ * End-to-end benchmark of remote thread calls
+ *
+ * Starts local remotethread-server instances on loopback and reports the
+ * call latency percentiles and the throughput versus the heap size, the
+ * number of concurrent tasks and the reply size. Run it from the source
+ * directory so that the servers find libremotethread.so. The default
+ * sweep is short, --full adds a 32 MB heap, 16 tasks and 64 KB replies.
+ *
+ * Usage: ./call-bench [servers] [rounds] [--full] [remotethread options]
+ */
+#include <remotethread.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define BASE_PORT		13950
+#define MAX_TASKS		64
+
+struct bench_param {
+	size_t reply_len;
+};
+
+void *bench_func(const void *param, size_t param_len, size_t *reply_len)
+{
+	if (param_len != sizeof(struct bench_param))
+		return NULL;
+	const struct bench_param *par = param;
+
+	*reply_len = par->reply_len;
+	char *reply = malloc(par->reply_len);
+	if (reply == NULL)
+		return NULL;
+	memset(reply, 0x5a, par->reply_len);
+	return reply;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static pid_t start_server(int port)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		char buf[16];
+		sprintf(buf, "%d", port);
+		execl("./remotethread-server", "remotethread-server",
+		      "--port", buf, NULL);
+		perror("exec remotethread-server");
+		_exit(1);
+	}
+	return pid;
+}
+
+/* runs rounds of tasks concurrent calls, returns the number of failures */
+static int run(int tasks, size_t reply_len, int rounds, double *latency,
+	       double *elapsed)
+{
+	struct remotethread *threads[MAX_TASKS];
+	double start[MAX_TASKS];
+	int failed = 0;
+	int n = 0;
+	int round, i;
+
+	double begin = now();
+	for (round = 0; round < rounds; ++round) {
+		struct bench_param par;
+		par.reply_len = reply_len;
+		for (i = 0; i < tasks; ++i) {
+			start[i] = now();
+			threads[i] = call_remotethread(bench_func, &par,
+						       sizeof par);
+			if (threads[i] == NULL)
+				failed++;
+		}
+
+		int left = tasks;
+		while (left > 0) {
+			int progress = 0;
+			for (i = 0; i < tasks; ++i) {
+				if (threads[i] == NULL)
+					continue;
+				size_t len;
+				void *reply = poll_remotethread(threads[i],
+								&len);
+				if (reply == RT_EAGAIN)
+					continue;
+				if (reply == NULL)
+					failed++;
+				else
+					latency[n++] = now() - start[i];
+				free(reply);
+				destroy_remotethread(threads[i]);
+				threads[i] = NULL;
+				progress = 1;
+			}
+			left = 0;
+			for (i = 0; i < tasks; ++i)
+				left += threads[i] != NULL;
+			if (progress == 0)
+				usleep(100);
+		}
+	}
+	*elapsed = now() - begin;
+	qsort(latency, n, sizeof *latency, compare_double);
+	return failed;
+}
+
+/* the leading numeric argument at pos, if there is one */
+static int number_arg(int argc, char **argv, int pos, int def)
+{
+	int i;
+	for (i = 1; i <= pos; ++i) {
+		if (i >= argc || argv[i][0] < '0' || argv[i][0] > '9')
+			return def;
+	}
+	return atoi(argv[pos]);
+}
+
+int main(int argc, char **argv)
+{
+	int num_servers = number_arg(argc, argv, 1, 2);
+	int rounds = number_arg(argc, argv, 2, 3);
+	static const size_t heap_sizes[] = {1 << 20, 8 << 20, 32 << 20};
+	static const int task_counts[] = {1, 4, 16};
+	static const size_t reply_sizes[] = {16, 1 << 20, 64 << 10};
+
+	pid_t pids[16];
+	char addrs[16][32];
+	int i;
+	if (num_servers < 1 || num_servers > 16) {
+		fprintf(stderr, "invalid number of servers\n");
+		return 1;
+	}
+
+	/* the local servers are added to the ones given, if any */
+	char **args = calloc(argc + 2 * num_servers + 1, sizeof *args);
+	if (args == NULL)
+		return 1;
+	int nargs = 0;
+	for (i = 0; i < argc; ++i)
+		args[nargs++] = argv[i];
+	for (i = 0; i < num_servers; ++i) {
+		sprintf(addrs[i], "127.0.0.1:%d", BASE_PORT + i);
+		args[nargs++] = "--remotethread";
+		args[nargs++] = addrs[i];
+	}
+	if (init_remotethread(&nargs, &args))
+		return 1;
+
+	int full = 0;
+	for (i = 1; i < nargs; ++i)
+		full |= strcmp(args[i], "--full") == 0;
+	size_t num_heaps = full ? 3 : 2;
+	size_t num_tasks = full ? 3 : 2;
+	size_t num_replies = full ? 3 : 2;
+
+	for (i = 0; i < num_servers; ++i)
+		pids[i] = start_server(BASE_PORT + i);
+	/* give the servers time to start listening */
+	sleep(1);
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	double *latency = malloc(sizeof(double) * MAX_TASKS * rounds);
+	printf("%10s %6s %10s %10s %10s %10s %10s\n", "heap", "tasks",
+	       "reply B", "p50 ms", "p90 ms", "p99 ms", "calls/s");
+
+	size_t h, t, r;
+	for (h = 0; h < num_heaps; ++h) {
+		/* somewhat compressible heap contents */
+		unsigned char *heap = remotethread_malloc(heap_sizes[h], NULL);
+		size_t p;
+		for (p = 0; p < heap_sizes[h]; ++p)
+			heap[p] = rand() & 0x0f;
+
+		for (t = 0; t < num_tasks; ++t) {
+			for (r = 0; r < num_replies; ++r) {
+				double elapsed;
+				int failed = run(task_counts[t], reply_sizes[r],
+						 rounds, latency, &elapsed);
+				int n = task_counts[t] * rounds - failed;
+				if (n == 0) {
+					printf("all calls failed\n");
+					continue;
+				}
+				printf("%9zuK %6d %10zu %10.2f %10.2f %10.2f "
+				       "%10.1f\n", heap_sizes[h] >> 10,
+				       task_counts[t], reply_sizes[r],
+				       latency[n / 2] * 1e3,
+				       latency[n * 9 / 10] * 1e3,
+				       latency[n * 99 / 100] * 1e3,
+				       n / elapsed);
+				if (failed)
+					printf("%d calls failed\n", failed);
+			}
+		}
+		remotethread_free(heap, NULL);
+	}
+	free(latency);
+
+	struct remotethread_stats st;
+	remotethread_get_stats(-1, &st);
+	uint64_t done = st.calls - st.errors;
+	printf("\n%" PRIu64 " calls, %" PRIu64 " errors, %.1f MB sent, "
+	       "compression ratio %.2f\n", st.calls, st.errors,
+	       st.bytes_sent / 1e6,
+	       st.heap_compr_bytes ? (double) st.heap_bytes /
+	       st.heap_compr_bytes : 0.0);
+	printf("%-16s %10s %10s\n", "phase", "mean ms", "max ms");
+	for (i = 0; i < RT_NUM_PHASES && done; ++i) {
+		printf("%-16s %10.2f %10.2f\n", remotethread_phase_name(i),
+		       st.phase_time[i] / 1e6 / done, st.phase_max[i] / 1e6);
+	}
+
+	for (i = 0; i < num_servers; ++i) {
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+	}
+	return 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * End-to-end test of remote thread calls against a local server
+ *
+ * Starts remotethread-server on loopback, so run it from the source
+ * directory like call-bench.
+ */
+#include <remotethread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#define TEST_PORT		13990
+#define NUM_ITEMS		1000
+#define NUM_WORKERS		"4"
+
+/* the sum of the indexes of a range */
+void *sum_range(const void *arg, size_t arg_len, const void *items,
+		size_t begin, size_t end, size_t *reply_len)
+{
+	(void) arg;
+	(void) arg_len;
+	(void) items;
+	uint64_t *sum = malloc(sizeof *sum);
+	if (sum == NULL)
+		return NULL;
+	*sum = 0;
+	for (; begin < end; ++begin)
+		*sum += begin;
+	*reply_len = sizeof *sum;
+	return sum;
+}
+
+/* like sum_range, but the first worker to reach the middle dies */
+void *sum_range_or_die(const void *arg, size_t arg_len, const void *items,
+		       size_t begin, size_t end, size_t *reply_len)
+{
+	if (begin <= NUM_ITEMS / 2 && NUM_ITEMS / 2 < end
+	    && open(arg, O_CREAT | O_EXCL | O_WRONLY, 0600) >= 0)
+		_exit(1);
+	return sum_range(arg, arg_len, items, begin, end, reply_len);
+}
+
+void *add_sums(const void *arg, size_t arg_len, void *a, size_t a_len,
+	       void *b, size_t b_len, size_t *reply_len)
+{
+	(void) arg;
+	(void) arg_len;
+	(void) a_len;
+	(void) b_len;
+	*(uint64_t *) a += *(uint64_t *) b;
+	*reply_len = sizeof(uint64_t);
+	return a;
+}
+
+void *square(const void *param, size_t param_len, size_t *reply_len)
+{
+	if (param_len != sizeof(uint64_t))
+		return NULL;
+	uint64_t *res = malloc(sizeof *res);
+	if (res == NULL)
+		return NULL;
+	*res = *(const uint64_t *) param * *(const uint64_t *) param;
+	*reply_len = sizeof *res;
+	return res;
+}
+
+/* sleeps for the given milliseconds */
+void *nap(const void *param, size_t param_len, size_t *reply_len)
+{
+	if (param_len != sizeof(int))
+		return NULL;
+	usleep(*(const int *) param * 1000);
+	*reply_len = 1;
+	return malloc(1);
+}
+
+struct bytes {
+	const unsigned char *buf;
+	size_t len;
+};
+
+/* the sum of bytes in the heap */
+void *sum_bytes(const void *param, size_t param_len, size_t *reply_len)
+{
+	if (param_len != sizeof(struct bytes))
+		return NULL;
+	const struct bytes *b = param;
+	uint64_t *sum = malloc(sizeof *sum);
+	if (sum == NULL)
+		return NULL;
+	*sum = 0;
+	size_t i;
+	for (i = 0; i < b->len; ++i)
+		*sum += b->buf[i];
+	*reply_len = sizeof *sum;
+	return sum;
+}
+
+static pid_t start_server(int port, const char *heap_dir)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		char buf[16];
+		sprintf(buf, "%d", port);
+		execl("./remotethread-server", "remotethread-server",
+		      "--port", buf, "--heap-dir", heap_dir, NULL);
+		perror("exec remotethread-server");
+		_exit(1);
+	}
+	return pid;
+}
+
+/* a call before anything has been allocated */
+static void test_empty_call(void)
+{
+	uint64_t x = 12345;
+	struct remotethread *rt = call_remotethread(square, &x, sizeof x);
+	assert(rt);
+	size_t len;
+	uint64_t *res = wait_remotethread(rt, &len);
+	assert(res && len == sizeof *res && *res == x * x);
+	free(res);
+	destroy_remotethread(rt);
+}
+
+/* the call that returns first is found without polling */
+static void test_wait_any(void)
+{
+	int ms[2] = {500, 50};
+	struct remotethread *rt[2];
+	int i;
+	for (i = 0; i < 2; ++i) {
+		rt[i] = call_remotethread(nap, &ms[i], sizeof ms[i]);
+		assert(rt[i]);
+	}
+	assert(remotethread_wait_any(rt, 2) == 1);
+	for (i = 1; i >= 0; --i) {
+		size_t len;
+		void *res = wait_remotethread(rt[i], &len);
+		assert(res && len == 1);
+		free(res);
+		destroy_remotethread(rt[i]);
+	}
+}
+
+/* map and reduce over index ranges with nothing in the heap */
+static void test_empty_heap(void)
+{
+	struct remotethread_range range;
+	range.num_items = NUM_ITEMS;
+	range.items = NULL;
+	range.item_size = 0;
+	size_t len;
+	uint64_t *sum = remotethread_parallel_reduce(sum_range, add_sums, NULL,
+						     0, &range, &len);
+	assert(sum && len == sizeof *sum);
+	assert(*sum == (uint64_t) NUM_ITEMS * (NUM_ITEMS - 1) / 2);
+	free(sum);
+}
+
+/* the ranges of a worker that dies are run by the others */
+static void test_failed_worker(const char *heap_dir)
+{
+	char marker[64];
+	sprintf(marker, "%s/died", heap_dir);
+	struct remotethread_range range;
+	range.num_items = NUM_ITEMS;
+	range.items = NULL;
+	range.item_size = 0;
+	size_t len;
+	uint64_t *sum = remotethread_parallel_reduce(sum_range_or_die,
+						     add_sums, marker,
+						     strlen(marker) + 1,
+						     &range, &len);
+	assert(access(marker, F_OK) == 0);
+	assert(sum && len == sizeof *sum);
+	assert(*sum == (uint64_t) NUM_ITEMS * (NUM_ITEMS - 1) / 2);
+	free(sum);
+	unlink(marker);
+}
+
+/* reserved memory of the server, after the exited calls are reaped */
+static uint64_t reserved_memory(void)
+{
+	struct remotethread_server_status st;
+	int i;
+	for (i = 0; i < 100; ++i) {
+		assert(remotethread_server_status(0, &st) == 0);
+		if (st.reserved == 0)
+			break;
+		usleep(10000);
+	}
+	return st.reserved;
+}
+
+/* a call on a published heap holds memory while its process runs */
+static void test_published_reservation(int version, size_t heap_len)
+{
+	int ms = 500;
+	struct remotethread *rt = call_published_remotethread(version, nap,
+							      &ms, sizeof ms);
+	assert(rt);
+	usleep(200000);
+	struct remotethread_server_status st;
+	assert(remotethread_server_status(0, &st) == 0);
+	assert(st.calls == 1 && st.reserved >= heap_len);
+	size_t len;
+	void *res = wait_remotethread(rt, &len);
+	assert(res && len == 1);
+	free(res);
+	destroy_remotethread(rt);
+	assert(reserved_memory() == 0);
+}
+
+/* the files left in the heap directory of the server */
+static int count_files(const char *dir)
+{
+	DIR *d = opendir(dir);
+	assert(d);
+	struct dirent *e;
+	int n = 0;
+	while ((e = readdir(d)) != NULL)
+		if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+			++n;
+	closedir(d);
+	return n;
+}
+
+/* whether a host listens for calls on a heap of the test server */
+static int host_listening(void)
+{
+	char name[32], line[256];
+	sprintf(name, "@remotethread-%d-", TEST_PORT);
+	FILE *f = fopen("/proc/net/unix", "r");
+	assert(f);
+	int found = 0;
+	while (fgets(line, sizeof line, f))
+		if (strstr(line, name))
+			found = 1;
+	fclose(f);
+	return found;
+}
+
+/* the server maps a checkpoint of the heap as a published heap */
+static void test_checkpoint(const char *heap_dir, const char *heap,
+			    size_t heap_len)
+{
+	char fname[64];
+	sprintf(fname, "%s.checkpoint", heap_dir);
+	assert(remotethread_checkpoint(fname) == 0);
+	int version = remotethread_publish_checkpoint(fname, NULL, 0);
+	assert(version >= 0);
+	struct bytes b;
+	b.buf = (const unsigned char *) heap;
+	b.len = heap_len;
+	struct remotethread *rt = call_published_remotethread(version,
+							      sum_bytes, &b,
+							      sizeof b);
+	assert(rt);
+	size_t len;
+	uint64_t *sum = wait_remotethread(rt, &len);
+	assert(sum && len == sizeof *sum && *sum == heap_len);
+	free(sum);
+	destroy_remotethread(rt);
+	assert(remotethread_unpublish(version) == 0);
+	assert(count_files(heap_dir) == 0);
+	unlink(fname);
+}
+
+int main(int argc, char **argv)
+{
+	/* the local server is added to the ones given, if any */
+	char addr[32];
+	sprintf(addr, "127.0.0.1:%d", TEST_PORT);
+	char **args = calloc(argc + 5, sizeof *args);
+	if (args == NULL)
+		return 1;
+	int nargs;
+	for (nargs = 0; nargs < argc; ++nargs)
+		args[nargs] = argv[nargs];
+	args[nargs++] = "--remotethread";
+	args[nargs++] = addr;
+	args[nargs++] = "--remotethread-workers";
+	args[nargs++] = NUM_WORKERS;
+	if (init_remotethread(&nargs, &args))
+		return 1;
+
+	char heap_dir[] = "/tmp/remotethread-test-XXXXXX";
+	if (mkdtemp(heap_dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	pid_t pid = start_server(TEST_PORT, heap_dir);
+	/* give the server time to start listening */
+	sleep(1);
+
+	/* these need the heap empty */
+	test_empty_call();
+	test_empty_heap();
+	test_failed_worker(heap_dir);
+	test_wait_any();
+
+	size_t heap_len = 4 << 20;
+	char *heap = remotethread_malloc(heap_len, NULL);
+	memset(heap, 1, heap_len);
+	int version = remotethread_publish(NULL, 0);
+	assert(version >= 0);
+	test_published_reservation(version, heap_len);
+	assert(count_files(heap_dir) == 2 && host_listening());
+	assert(remotethread_unpublish(version) == 0);
+	assert(count_files(heap_dir) == 0 && !host_listening());
+	test_checkpoint(heap_dir, heap, heap_len);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	rmdir(heap_dir);
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Test of the C++ front end against a local server, built as C++20 so
+ * that both futures and coroutines are covered
+ *
+ * Starts remotethread-server on loopback, so run it from the source
+ * directory like call-test.
+ */
+#include <remotethread.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <stdexcept>
+#include <sys/wait.h>
+
+#define TEST_PORT		13991
+#define NUM_JOBS		16
+
+struct range {
+	uint64_t begin;
+	uint64_t end;
+};
+
+struct sum_reply {
+	uint64_t sum;
+	uint64_t count;
+};
+
+/* the sum of the numbers of a range */
+sum_reply sum(const range &r) noexcept
+{
+	sum_reply res = {0, r.end - r.begin};
+	for (uint64_t i = r.begin; i < r.end; ++i)
+		res.sum += i;
+	return res;
+}
+
+/* the numbers of a range */
+rthread::buffer numbers(range r)
+{
+	rthread::buffer buf = rthread::buffer::allocate((r.end - r.begin)
+							* sizeof(uint64_t));
+	uint64_t *num = static_cast<uint64_t *>(buf.data());
+	if (num)
+		for (uint64_t i = r.begin; i < r.end; ++i)
+			num[i - r.begin] = i;
+	return buf;
+}
+
+/* throws for a reversed range */
+sum_reply checked_sum(const range &r)
+{
+	if (r.begin > r.end)
+		throw std::invalid_argument("reversed range");
+	return sum(r);
+}
+
+static bool check_sum(const rthread::reply<sum_reply> &res, const range &r)
+{
+	return res && res->count == r.end - r.begin
+		&& res->sum == (r.begin + r.end - 1) * (r.end - r.begin) / 2;
+}
+
+static bool check_numbers(const rthread::buffer &buf, const range &r)
+{
+	if (!buf || buf.size() != (r.end - r.begin) * sizeof(uint64_t))
+		return false;
+	const uint64_t *num = static_cast<const uint64_t *>(buf.data());
+	for (uint64_t i = r.begin; i < r.end; ++i)
+		if (num[i - r.begin] != i)
+			return false;
+	return true;
+}
+
+static void test_futures()
+{
+	range r = {10, 1000};
+	auto f = rthread::call<sum>(r);
+	auto g = rthread::call<numbers>(r);
+	assert(check_numbers(g.get(), r));
+	assert(check_sum(f.get(), r));
+
+	/* an exception fails the call */
+	range reversed = {r.end, r.begin};
+	assert(!rthread::call<checked_sum>(reversed).get());
+	assert(check_sum(rthread::call<checked_sum>(r).get(), r));
+
+	/* a future without a call has failed */
+	rthread::future<sum_reply> none;
+	assert(none.ready() && !none.get());
+}
+
+#ifdef REMOTETHREAD_COROUTINES
+static int jobs_done = 0;
+
+/* a call that depends on the reply of another */
+static rthread::job sum_then_numbers(range r)
+{
+	auto res = co_await rthread::call<sum>(r);
+	assert(check_sum(res, r));
+	range next = {r.begin, r.begin + res->count / 2};
+	auto buf = co_await rthread::call<numbers>(next);
+	assert(check_numbers(buf, next));
+	jobs_done++;
+}
+
+static void test_coroutines()
+{
+	int i;
+	for (i = 0; i < NUM_JOBS; ++i)
+		sum_then_numbers(range{(uint64_t) i, (uint64_t) i * 100 + 2});
+	assert(rthread::run() == 2 * NUM_JOBS);
+	assert(jobs_done == NUM_JOBS);
+}
+#endif
+
+static pid_t start_server(int port)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		char buf[16];
+		sprintf(buf, "%d", port);
+		execl("./remotethread-server", "remotethread-server",
+		      "--port", buf, NULL);
+		perror("exec remotethread-server");
+		_exit(1);
+	}
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	/* the local server is added to the ones given, if any */
+	char addr[32];
+	sprintf(addr, "127.0.0.1:%d", TEST_PORT);
+	std::vector<char *> args(argv, argv + argc);
+	args.push_back(const_cast<char *>("--remotethread"));
+	args.push_back(addr);
+	args.push_back(NULL);
+	int nargs = args.size() - 1;
+	char **argp = args.data();
+	if (init_remotethread(&nargs, &argp))
+		return 1;
+
+	pid_t pid = start_server(TEST_PORT);
+	/* give the server time to start listening */
+	sleep(1);
+
+	test_futures();
+#ifdef REMOTETHREAD_COROUTINES
+	test_coroutines();
+#else
+	printf("no coroutines, ");
+#endif
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	printf("OK\n");
+	return 0;
+}
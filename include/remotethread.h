@@ -2,6 +2,11 @@
 #define _REMOTETHREAD_H
 
 #include <string.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct remotethread;
 
@@ -12,15 +17,137 @@ void remotethread_check_alloc(void);
 void *remotethread_malloc(size_t size, const void *caller);
 void remotethread_free(void *ptr, const void *caller);
 void *remotethread_realloc(void *ptr, size_t new_size, const void *caller);
+void *remotethread_calloc(size_t nmemb, size_t size, const void *caller);
+void *remotethread_memalign(size_t alignment, size_t size,
+			    const void *caller);
+int remotethread_posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t remotethread_malloc_usable_size(void *ptr);
 
 #define RT_EAGAIN	((void *) -1)
 
 struct remotethread *call_remotethread(remotethread_func_t func,
 				       const void *param, size_t param_len);
+int broadcast_remotethread(remotethread_func_t func,
+			   const void *const *params, const size_t *param_lens,
+			   int num, struct remotethread **threads);
+
+/* a task of chain_remotethread() */
+struct remotethread_task {
+	remotethread_func_t func;
+	const void *param;
+	size_t param_len;
+	int after;	/* index of an earlier task, or -1 */
+};
+
+int chain_remotethread(const struct remotethread_task *tasks, int num,
+		       struct remotethread **threads);
+/*
+ * A published heap stays on the servers until it is unpublished. Its
+ * calls share one copy of it on each server, other calls do not.
+ */
+int remotethread_publish(const int *servers, int num);
+struct remotethread *call_published_remotethread(int version,
+						 remotethread_func_t func,
+						 const void *param,
+						 size_t param_len);
+int remotethread_unpublish(int version);
+/*
+ * A checkpoint is restored with --remotethread-restore [file] or with
+ * remotethread_restore() before anything is allocated. Servers that can
+ * read the file map it as a published heap.
+ */
+int remotethread_checkpoint(const char *fname);
+int remotethread_restore(const char *fname);
+int remotethread_publish_checkpoint(const char *fname, const int *servers,
+				    int num);
+
 void *poll_remotethread(struct remotethread *rt, size_t *reply_len);
+/* the index of a task that poll_remotethread() has a result for */
+int remotethread_wait_any(struct remotethread *const *threads, int num);
 void *wait_remotethread(struct remotethread *rt, size_t *reply_len);
 void destroy_remotethread(struct remotethread *rt);
+void remotethread_cancel(struct remotethread *rt);
+void remotethread_set_timeout(unsigned int ms);
+
+/* processes items begin..end-1, items points to them if they are sent */
+typedef void *(*remotethread_map_t)(const void *arg, size_t arg_len,
+				    const void *items, size_t begin, size_t end,
+				    size_t *reply_len);
+/* combines two results, may return one of them */
+typedef void *(*remotethread_reduce_t)(const void *arg, size_t arg_len,
+				       void *a, size_t a_len, void *b,
+				       size_t b_len, size_t *reply_len);
+/* receives the result of items begin..end-1 */
+typedef void (*remotethread_collect_t)(void *ctx, size_t begin, size_t end,
+				       const void *reply, size_t reply_len);
+
+struct remotethread_range {
+	size_t num_items;
+	/* if set, only these items are sent instead of the heap */
+	const void *items;
+	size_t item_size;
+};
+
+int remotethread_parallel_map(remotethread_map_t map, const void *arg,
+			      size_t arg_len,
+			      const struct remotethread_range *range,
+			      remotethread_collect_t collect, void *ctx);
+void *remotethread_parallel_reduce(remotethread_map_t map,
+				   remotethread_reduce_t reduce,
+				   const void *arg, size_t arg_len,
+				   const struct remotethread_range *range,
+				   size_t *reply_len);
+
+enum remotethread_phase {
+	/* measured by the client */
+	RT_PHASE_CONNECT,
+	RT_PHASE_READ_BINARY,
+	RT_PHASE_SEND_BINARY,
+	RT_PHASE_ZERO,
+	RT_PHASE_DEFLATE,
+	RT_PHASE_SEND_HEAP,
+	RT_PHASE_WAIT,		/* heap sent until the reply header arrives */
+	RT_PHASE_RECV_REPLY,
+	/* measured by the server and the slave */
+	RT_PHASE_RECV_BINARY,
+	RT_PHASE_EXEC,
+	RT_PHASE_RECV_HEAP,
+	RT_PHASE_INFLATE,
+	RT_PHASE_FUNC,
+	RT_NUM_PHASES,
+};
+
+struct remotethread_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes_sent;	/* headers, binaries and compressed heaps */
+	uint64_t heap_bytes;	/* heap images before compression */
+	uint64_t heap_compr_bytes;
+	uint64_t reply_bytes;
+	uint64_t cache_hits;	/* calls answered from a cache */
+	uint64_t retries;	/* calls sent again after a server failed */
+	uint64_t phase_time[RT_NUM_PHASES];	/* sum, nanoseconds */
+	uint64_t phase_max[RT_NUM_PHASES];
+};
+
+/* memory of a server, calls are admitted while their heaps fit */
+struct remotethread_server_status {
+	uint64_t memory;
+	uint64_t reserved;
+	uint32_t calls;
+};
+
+int remotethread_num_servers(void);
+int remotethread_get_stats(int server, struct remotethread_stats *stats);
+int remotethread_server_status(int server,
+			       struct remotethread_server_status *status);
+const char *remotethread_phase_name(int phase);
+int remotethread_write_trace(const char *fname);
 
 int init_remotethread(int *argc, char ***argv);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,442 @@
+/*
+ * C++ front end of remotethread, header only (C++17, coroutines with C++20)
+ *
+ * A remote function takes a trivially copyable parameter struct and
+ * returns either a trivially copyable value or a buffer:
+ *
+ *	result sum(const range &r);
+ *	rthread::call<sum>(r)	returns a future<result>
+ *
+ * The parameter size is checked by a trampoline generated for the
+ * function, and the reply is kept in the buffer it arrived in.
+ */
+#ifndef _REMOTETHREAD_HPP
+#define _REMOTETHREAD_HPP
+
+#include <remotethread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define REMOTETHREAD_COROUTINES	1
+#endif
+
+namespace rthread {
+
+/* a reply as it was received, owned and freed with free() */
+class buffer {
+public:
+	buffer() : data_(NULL), size_(0) {}
+	buffer(void *data, size_t size) : data_(data), size_(size) {}
+	buffer(buffer &&other) noexcept
+		: data_(other.data_), size_(other.size_)
+	{
+		other.data_ = NULL;
+		other.size_ = 0;
+	}
+	buffer &operator=(buffer &&other) noexcept
+	{
+		if (this != &other) {
+			free(data_);
+			data_ = other.data_;
+			size_ = other.size_;
+			other.data_ = NULL;
+			other.size_ = 0;
+		}
+		return *this;
+	}
+	buffer(const buffer &) = delete;
+	buffer &operator=(const buffer &) = delete;
+	~buffer()
+	{
+		free(data_);
+	}
+
+	/* a buffer of size bytes for a remote function to fill in */
+	static buffer allocate(size_t size)
+	{
+		/* an empty reply is not a failed one */
+		void *data = malloc(size ? size : 1);
+		return buffer(data, data ? size : 0);
+	}
+
+	void *data() const
+	{
+		return data_;
+	}
+	size_t size() const
+	{
+		return size_;
+	}
+	/* NULL if the call failed */
+	explicit operator bool() const
+	{
+		return data_ != NULL;
+	}
+	void *release()
+	{
+		void *data = data_;
+		data_ = NULL;
+		size_ = 0;
+		return data;
+	}
+
+private:
+	void *data_;
+	size_t size_;
+};
+
+/* a reply holding a T in place, empty if the call failed */
+template <typename T>
+class reply {
+	static_assert(std::is_trivially_copyable<T>::value,
+		      "replies must be trivially copyable");
+public:
+	reply() {}
+	explicit reply(buffer &&buf)
+	{
+		if (buf.size() == sizeof(T))
+			buf_ = std::move(buf);
+	}
+
+	T *get() const
+	{
+		return static_cast<T *>(buf_.data());
+	}
+	T &operator*() const
+	{
+		return *get();
+	}
+	T *operator->() const
+	{
+		return get();
+	}
+	explicit operator bool() const
+	{
+		return static_cast<bool>(buf_);
+	}
+
+private:
+	buffer buf_;
+};
+
+namespace detail {
+
+template <typename F>
+struct function_traits;
+
+template <typename R, typename P>
+struct function_traits<R (*)(const P &)> {
+	typedef R result;
+	typedef P param;
+};
+
+template <typename R, typename P>
+struct function_traits<R (*)(P)> {
+	typedef R result;
+	typedef P param;
+};
+
+/* noexcept is part of the type of a function since C++17 */
+template <typename R, typename P>
+struct function_traits<R (*)(const P &) noexcept> {
+	typedef R result;
+	typedef P param;
+};
+
+template <typename R, typename P>
+struct function_traits<R (*)(P) noexcept> {
+	typedef R result;
+	typedef P param;
+};
+
+/* what the future of a function returning R gives */
+template <typename R>
+struct result_of_call {
+	typedef reply<R> type;
+};
+
+template <>
+struct result_of_call<buffer> {
+	typedef buffer type;
+};
+
+template <auto F>
+void *run_function(const void *param, size_t *reply_len)
+{
+	typedef function_traits<decltype(F)> traits;
+	typedef typename traits::param P;
+	typedef typename traits::result R;
+	const P &par = *static_cast<const P *>(param);
+
+	if constexpr (std::is_same<R, buffer>::value) {
+		buffer buf = F(par);
+		*reply_len = buf.size();
+		return buf.release();
+	} else {
+		R res = F(par);
+		void *buf = malloc(sizeof(R));
+		if (buf == NULL)
+			return NULL;
+		new (buf) R(res);
+		*reply_len = sizeof(R);
+		return buf;
+	}
+}
+
+/*
+ * Runs on the server, in place of a C remote function. An exception
+ * fails the call rather than unwinding into C.
+ */
+template <auto F>
+void *trampoline(const void *param, size_t param_len, size_t *reply_len)
+{
+	typedef typename function_traits<decltype(F)>::param P;
+	if (param_len != sizeof(P))
+		return NULL;
+#if __cpp_exceptions
+	try {
+		return run_function<F>(param, reply_len);
+	} catch (...) {
+		return NULL;
+	}
+#else
+	return run_function<F>(param, reply_len);
+#endif
+}
+
+} /* namespace detail */
+
+/*
+ * The reply of a call on its way. Destroying the future gives up on the
+ * call, and the server kills it.
+ */
+template <typename R>
+class future {
+public:
+	typedef typename detail::result_of_call<R>::type result_type;
+
+	/* a future without a call, which has failed */
+	future() : rt_(NULL), done_(true) {}
+	explicit future(struct remotethread *rt) : rt_(rt), done_(rt == NULL)
+	{
+	}
+	future(future &&other) noexcept
+		: rt_(other.rt_), done_(other.done_),
+		  result_(std::move(other.result_))
+	{
+		other.rt_ = NULL;
+		other.done_ = true;
+	}
+	future &operator=(future &&other) noexcept
+	{
+		if (this != &other) {
+			if (rt_)
+				destroy_remotethread(rt_);
+			rt_ = other.rt_;
+			done_ = other.done_;
+			result_ = std::move(other.result_);
+			other.rt_ = NULL;
+			other.done_ = true;
+		}
+		return *this;
+	}
+	future(const future &) = delete;
+	future &operator=(const future &) = delete;
+	~future()
+	{
+		if (rt_)
+			destroy_remotethread(rt_);
+	}
+
+	/* whether the reply has arrived or the call has failed */
+	bool ready()
+	{
+		if (done_)
+			return true;
+		size_t len;
+		void *data = poll_remotethread(rt_, &len);
+		if (data == RT_EAGAIN)
+			return false;
+		finish(data, len);
+		return true;
+	}
+
+	/* waits for the reply, which can be taken once */
+	result_type get()
+	{
+		if (!done_) {
+			size_t len;
+			void *data = wait_remotethread(rt_, &len);
+			finish(data, len);
+		}
+		return std::move(result_);
+	}
+
+	void cancel()
+	{
+		if (rt_ && !done_)
+			remotethread_cancel(rt_);
+	}
+
+#ifdef REMOTETHREAD_COROUTINES
+	bool await_ready()
+	{
+		return ready();
+	}
+	void await_suspend(std::coroutine_handle<> handle);
+	result_type await_resume()
+	{
+		return get();
+	}
+#endif
+
+private:
+	void finish(void *data, size_t len)
+	{
+		buffer buf(data, data ? len : 0);
+		result_ = result_type(std::move(buf));
+		destroy_remotethread(rt_);
+		rt_ = NULL;
+		done_ = true;
+	}
+
+	struct remotethread *rt_;
+	bool done_;
+	result_type result_;
+};
+
+/* runs F(param) on a server */
+template <auto F, typename P>
+future<typename detail::function_traits<decltype(F)>::result>
+call(const P &param)
+{
+	typedef detail::function_traits<decltype(F)> traits;
+	static_assert(std::is_same<typename std::decay<P>::type,
+		      typename traits::param>::value,
+		      "the parameter does not match the function");
+	static_assert(std::is_trivially_copyable<P>::value,
+		      "parameters must be trivially copyable");
+	typedef typename traits::result R;
+	static_assert(std::is_same<R, buffer>::value
+		      || std::is_trivially_copyable<R>::value,
+		      "the function must return a buffer or a trivially "
+		      "copyable value");
+	return future<R>(call_remotethread(detail::trampoline<F>, &param,
+					   sizeof param));
+}
+
+#ifdef REMOTETHREAD_COROUTINES
+
+namespace detail {
+
+/* a coroutine waiting for a call, and how to check on the call */
+struct waiter {
+	std::coroutine_handle<> handle;
+	void *future;
+	bool (*ready)(void *future);
+	struct remotethread *rt;
+};
+
+inline std::vector<waiter> &waiters()
+{
+	static thread_local std::vector<waiter> list;
+	return list;
+}
+
+template <typename R>
+bool future_ready(void *f)
+{
+	return static_cast<future<R> *>(f)->ready();
+}
+
+} /* namespace detail */
+
+template <typename R>
+void future<R>::await_suspend(std::coroutine_handle<> handle)
+{
+	detail::waiter w;
+	w.handle = handle;
+	w.future = this;
+	w.ready = detail::future_ready<R>;
+	w.rt = rt_;
+	detail::waiters().push_back(w);
+}
+
+/*
+ * A coroutine that is started at once and runs until it is done, its
+ * calls are awaited in run(). For example:
+ *
+ *	rthread::job sum_all(const range &r, result &out)
+ *	{
+ *		auto res = co_await rthread::call<sum>(r);
+ *		if (res)
+ *			out = *res;
+ *	}
+ */
+struct job {
+	struct promise_type {
+		job get_return_object()
+		{
+			return job();
+		}
+		std::suspend_never initial_suspend() noexcept
+		{
+			return std::suspend_never();
+		}
+		std::suspend_never final_suspend() noexcept
+		{
+			return std::suspend_never();
+		}
+		void return_void() {}
+		void unhandled_exception()
+		{
+			abort();
+		}
+	};
+};
+
+/*
+ * Resumes the coroutines as their calls complete, until none of them is
+ * waiting. Returns the number of coroutines resumed.
+ */
+inline size_t run()
+{
+	std::vector<detail::waiter> &list = detail::waiters();
+	size_t resumed = 0;
+	while (!list.empty()) {
+		/* the resumed coroutines may wait for more calls */
+		std::vector<detail::waiter> ready;
+		size_t i, n = 0;
+		for (i = 0; i < list.size(); ++i) {
+			if (list[i].ready(list[i].future))
+				ready.push_back(list[i]);
+			else
+				list[n++] = list[i];
+		}
+		list.resize(n);
+		for (i = 0; i < ready.size(); ++i)
+			ready[i].handle.resume();
+		resumed += ready.size();
+		if (!ready.empty() || list.empty())
+			continue;
+
+		/* sleeps until one of the calls has something */
+		std::vector<struct remotethread *> rts;
+		for (i = 0; i < list.size(); ++i)
+			rts.push_back(list[i].rt);
+		if (remotethread_wait_any(rts.data(), rts.size()) < 0)
+			usleep(100);
+	}
+	return resumed;
+}
+
+#endif
+
+} /* namespace rthread */
+
+#endif
@@ -1,54 +1,250 @@
 /*
  * remotethread API library
  */
+#define _GNU_SOURCE
 #include "utils.h"
+#include "procs.h"
 #include "proto.h"
 #include "remotethread.h"
 #include <dlfcn.h>
+#include <link.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
 #include <zlib.h>
 
-#define MAX_SERVERS	16
+#define MAX_SERVERS	256
+/* the tree below a slave can not be larger than the whole broadcast */
+#define MAX_RELAYS	(1 << 20)
 
-struct remotethread {
+/* fan-out of the broadcast tree */
+#define BROADCAST_FANOUT	2
+/* a chained task gets its own parameters and the reply of its parent */
+#define MAX_PARAM_IOV		2
+
+/* ranges handed to a worker of a parallel map before it answers */
+#define WORKER_DEPTH		2
+/* workers of a parallel map per server */
+#define MAX_WORKERS		1024
+/* the first ranges measure the speed of the workers */
+#define PROBE_RANGES		64
+/* a range should take at least this long to hide the round trip */
+#define MIN_RANGE_NS		10000000
+
+/*
+ * A host of a published heap exits when it has been idle this long, or
+ * when the heap is unpublished and it checks for it.
+ */
+#define HOST_IDLE_MS		60000
+#define HOST_CHECK_MS		1000
+
+/* a server that was busy or failed a task is avoided for a while */
+#define BUSY_BACKOFF_NS		1000000000
+/* a failed task is sent again after this, doubled on each retry */
+#define RETRY_BACKOFF_NS	100000000
+/* the kernel probes an idle connection to detect a lost server */
+#define KEEPALIVE_IDLE		5
+#define KEEPALIVE_INTERVAL	1
+#define KEEPALIVE_COUNT		3
+
+/* hash buckets of the reply cache */
+#define CACHE_BUCKETS		1024
+/* the heap is hashed in blocks, the written ones are hashed again */
+#define HASH_BLOCK		(1 << 20)
+/* bit of a pagemap entry set when the page has been written */
+#define PM_SOFT_DIRTY		(1ULL << 55)
+#define PAGEMAP_BATCH		512
+
+enum {
+	TASK_PENDING,
+	TASK_READY,
+	TASK_FAILED,
+	TASK_RETRY,	/* to be sent again at retry_at */
+};
+
+/* a published heap on a server */
+enum {
+	PUSH_PENDING,
+	PUSH_STORED,
+	PUSH_FAILED,	/* or not pushed there */
+};
+
+/* answers of read_welcome() */
+enum {
+	WELCOME_OK,
+	WELCOME_CACHED,
+	WELCOME_BUSY,
+};
+
+/* tasks submitted together, replies are matched to them by index */
+struct batch {
+	int refs;
+	int num_tasks;
+	struct remotethread **tasks;
+};
+
+/* a connection to a server, carries the replies of a subtree of tasks */
+struct conn {
 	int fd;
+	int refs;
+	int failed;
+	struct reply reply;	/* header of the reply being received */
+	int have_reply;
+	struct remotethread *target;	/* NULL if the reply is skipped */
+	size_t discard;
+	struct batch *batch;
+};
+
+struct remotethread {
+	struct conn *conn;
+	uint32_t task;
+	int server;
+	int state;
 	struct reply reply;
+	int done;
+	int delivered;
 	size_t pos;
 	char *buf;
 	size_t reply_len;
+	uint64_t begin[RT_NUM_PHASES];
+	uint64_t phase[RT_NUM_PHASES];
+	int keyed;		/* the reply may be cached under key */
+	uint64_t key[2];
+	struct payload *payload;	/* NULL if the task is not retried */
+	struct relay entry;	/* how to start the task again */
+	int retries;
+	uint64_t retry_at;
+	uint64_t timeout;	/* nanoseconds, 0 if none */
+	uint64_t deadline;
+};
+
+/* a heap image ready to be sent */
+struct image {
+	size_t alloc_len;
+	size_t len;		/* before compression */
+	const void *data;
+	size_t data_len;
+	void *compr;		/* NULL if the heap is sent as is */
+};
+
+/* the image of a submission, kept until its tasks no longer need it */
+struct payload {
+	int refs;
+	struct image img;
+	size_t binary_len;
+};
+
+/* a cached reply, in the least recently used order */
+struct cache_entry {
+	uint64_t key[2];
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	struct cache_entry *chain;	/* in the hash bucket */
+	size_t len;
+	char data[];
+};
+
+/* a heap image pushed to servers by remotethread_publish() */
+struct publication {
+	uint64_t id[2];
+	pid_t pid;		/* the pushing process, 0 when it has finished */
+	int done_fd;		/* gets a byte as each server is done */
+	char *checkpoint;	/* on the servers, instead of the heap */
+	char *stored;		/* per server, shared with the pushing process */
+	int next_server;
+};
+
+/* a finished call, for the trace */
+struct trace_call {
+	int server;
+	uint64_t begin[RT_NUM_PHASES];
+	uint64_t phase[RT_NUM_PHASES];
 };
 
-static struct in_addr servers[MAX_SERVERS];
+static struct sockaddr_in servers[MAX_SERVERS];
+static struct remotethread_stats stats[MAX_SERVERS];
+static uint64_t avoid_until[MAX_SERVERS];
 static int num_servers = 0;
 static const char *my_binary = NULL;
+static int binary_fd = -1;
+static int compress_level = Z_DEFAULT_COMPRESSION;
+static int workers_per_server = 1;
+static int max_retries = 2;
+static uint64_t timeout_ns = 0;
+
+static int caching = 0;
+static size_t cache_limit = 0;
+static size_t cache_size = 0;
+static struct cache_entry *cache_buckets[CACHE_BUCKETS];
+static struct cache_entry *cache_head = NULL;
+static struct cache_entry *cache_tail = NULL;
+static uint64_t binary_hash[2];
+static int have_binary_hash = 0;
+static uint64_t (*block_hashes)[2] = NULL;
+static size_t num_block_hashes = 0;
+static size_t hashed_len = 0;
+static int soft_dirty = -1;	/* whether writes can be tracked, -1 unknown */
+static int pagemap_fd = -1;
+static int clear_refs_fd = -1;
+
+static struct publication *publications = NULL;
+static int num_publications = 0;
+
+static const char *trace_fname = NULL;
+static struct trace_call *trace = NULL;
+static size_t trace_len = 0;
+static size_t trace_size = 0;
 
-static void *read_file(const char *fname, size_t *len)
+/* time spent by the server to receive the binary, and when it exec'd us */
+static uint64_t server_times[2];
+static uint64_t slave_start;
+/* where the slave stores its reply for the cache of the server */
+static const char *cache_file = NULL;
+/* the stored call with the heap image of a published heap */
+static const char *heap_file = NULL;
+/* a host has the published heap in place before forking the slave */
+static int heap_loaded = 0;
+/* the heap the server has reserved memory for, 0 if not limited */
+static uint64_t reserved_len = 0;
+/* when the server kills the slave, the tasks it starts get what is left */
+static uint64_t slave_deadline = 0;
+
+static int find_load_bias(struct dl_phdr_info *info, size_t size, void *data)
 {
-	FILE *f = fopen(fname, "rb");
-	if (f == NULL) {
-		warning("Unable to open %s\n", fname);
-		return 0;
-	}
-	fseek(f, 0, SEEK_END);
-	*len = ftell(f);
-	void *buf = malloc(*len);
-	if (buf == NULL) {
-		fclose(f);
-		warning("Out of memory\n");
-		return 0;
+	UNUSED(size);
+	/* the first object is the executable itself */
+	*(uintptr_t *) data = info->dlpi_addr;
+	return 1;
+}
+
+/*
+ * Code addresses are sent relative to the load address of the executable,
+ * which is randomized for position independent executables.
+ */
+static uintptr_t load_bias(void)
+{
+	static uintptr_t bias = 0;
+	static int found = 0;
+	if (found == 0) {
+		dl_iterate_phdr(find_load_bias, &bias);
+		found = 1;
 	}
-	fseek(f, 0, SEEK_SET);
-	fread(buf, 1, *len, f);
-	fclose(f);
-	return buf;
+	return bias;
 }
 
 enum {
@@ -60,21 +256,59 @@ struct chunk {
 	struct chunk *prev;
 	size_t size;
 	int status;
+	int zeroed; /* free chunk with all zero payload */
 };
 
 #define ALLOC_BEGIN	0x40000000
 #define PAGE_SIZE	4096
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+/* the heap grows by at least 1/GROW_RATIO of its size, up to MAX_GROW */
+#define GROW_RATIO	8
+#define MAX_GROW	(1024 * 1024 * 1024)
+
+enum {
+	HUGEPAGES_NONE = 0,
+	HUGEPAGES_TRANSPARENT,
+	HUGEPAGES_EXPLICIT,
+};
 
 static struct chunk *const first_chunk = (struct chunk *) ALLOC_BEGIN;
 static struct chunk *last_chunk = NULL;
 static struct chunk *alloc_chunk = (struct chunk *) ALLOC_BEGIN;
 static char *current_end = (char *) ALLOC_BEGIN;
+static int hugepages = HUGEPAGES_NONE;
+
+static size_t heap_size(void)
+{
+	return current_end - (char *) ALLOC_BEGIN;
+}
 
 static size_t round_up(size_t val, size_t align)
 {
 	return (val + align - 1) & ~(align - 1);
 }
 
+/* the size of a chunk for size bytes, 0 if it would not fit in memory */
+static size_t chunk_len(size_t size)
+{
+	/* leaves room for rounding the end of an aligned chunk as well */
+	if (size > (size_t) -1 - 128)
+		return 0;
+	return round_up(size + sizeof(struct chunk), 64);
+}
+
+/* the header of next becomes a part of the payload of chunk */
+static void absorb_chunk(struct chunk *chunk, struct chunk *next)
+{
+	if (chunk->zeroed && next->zeroed)
+		memset(next, 0, sizeof *next);
+	else {
+		chunk->zeroed = 0;
+		next->status = 0xdeadbeef;
+	}
+}
+
 static struct chunk *merge_free_chunks(struct chunk *chunk)
 {
 	/* merge with previous */
@@ -83,7 +317,7 @@ static struct chunk *merge_free_chunks(struct chunk *chunk)
 		chunk = chunk->prev;
 		chunk->size += next->size;
 
-		next->status = 0xdeadbeef;
+		absorb_chunk(chunk, next);
 
 		/* fix back pointer */
 		if (next == last_chunk)
@@ -100,7 +334,7 @@ static struct chunk *merge_free_chunks(struct chunk *chunk)
 	if (next != (struct chunk *) current_end && next->status == CHUNK_FREE) {
 		chunk->size += next->size;
 
-		next->status = 0xdeadbeef;
+		absorb_chunk(chunk, next);
 
 		/* fix back pointer */
 		if (next == last_chunk)
@@ -115,25 +349,75 @@ static struct chunk *merge_free_chunks(struct chunk *chunk)
 	return chunk;
 }
 
-static struct chunk *grow_alloc(size_t size)
+static size_t grow_granularity(void)
 {
-	size = round_up(size, PAGE_SIZE * 16);
-	if (mmap(current_end, size, PROT_READ|PROT_WRITE,
-		 MAP_PRIVATE|MAP_ANONYMOUS, 0, 0) == MAP_FAILED) {
-		warning("unable to grow allocation\n");
-		return NULL;
+	if (hugepages != HUGEPAGES_NONE)
+		return HUGE_PAGE_SIZE;
+	return PAGE_SIZE * 16;
+}
+
+static int map_alloc(void *start, size_t size)
+{
+	int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+	if (hugepages == HUGEPAGES_EXPLICIT)
+		flags |= MAP_HUGETLB;
+
+	void *ptr = mmap(start, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if (ptr == MAP_FAILED && hugepages == HUGEPAGES_EXPLICIT) {
+		warning("no huge pages available, using transparent ones\n");
+		hugepages = HUGEPAGES_TRANSPARENT;
+		ptr = mmap(start, size, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+	if (ptr == MAP_FAILED) {
+		warning("mmap() failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (ptr != start) {
+		/* something else lives at the address */
+		warning("unable to map heap at %p\n", start);
+		munmap(ptr, size);
+		return -1;
 	}
+	if (hugepages == HUGEPAGES_TRANSPARENT)
+		madvise(start, size, MADV_HUGEPAGE);
+	return 0;
+}
 
+static struct chunk *append_free_chunk(size_t size)
+{
 	struct chunk *chunk = (void *) current_end;
 	current_end += size;
 
 	chunk->size = size;
 	chunk->status = CHUNK_FREE;
+	chunk->zeroed = 1;
 	chunk->prev = last_chunk;
 	last_chunk = chunk;
 	return merge_free_chunks(chunk);
 }
 
+static struct chunk *grow_alloc(size_t size)
+{
+	/* grow geometrically to keep the number of mmap() calls low */
+	size_t grow = (current_end - (char *) ALLOC_BEGIN) / GROW_RATIO;
+	if (grow > MAX_GROW)
+		grow = MAX_GROW;
+	if (grow < size)
+		grow = size;
+	grow = round_up(grow, grow_granularity());
+	if (grow < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (map_alloc(current_end, grow)) {
+		warning("unable to grow allocation\n");
+		return NULL;
+	}
+	return append_free_chunk(grow);
+}
+
 void remotethread_check_alloc(void)
 {
 	printf("----\n");
@@ -143,6 +427,12 @@ void remotethread_check_alloc(void)
 		printf("%p %zu %s\n", chunk, chunk->size,
 			chunk->status == CHUNK_FREE ? "free" : "allocated");
 		assert(chunk->prev == prev);
+		if (chunk->zeroed) {
+			size_t i;
+			assert(chunk->status == CHUNK_FREE);
+			for (i = sizeof(struct chunk); i < chunk->size; ++i)
+				assert(((const char *) chunk)[i] == 0);
+		}
 		prev = chunk;
 		chunk = (struct chunk *) ((char *) chunk + chunk->size);
 	}
@@ -177,6 +467,7 @@ static struct chunk *split_chunk(struct chunk *chunk, size_t pos)
 	struct chunk *new_chunk = (struct chunk *) ((char *) chunk + pos);
 	new_chunk->size = chunk->size - pos;
 	new_chunk->status = CHUNK_FREE;
+	new_chunk->zeroed = chunk->zeroed;
 	new_chunk->prev = chunk;
 
 	/* fix back pointer */
@@ -192,23 +483,116 @@ static struct chunk *split_chunk(struct chunk *chunk, size_t pos)
 	return new_chunk;
 }
 
+/* mark a free chunk allocated, returns whether the payload was zero */
+static int take_chunk(struct chunk *chunk, size_t size)
+{
+	chunk->status = CHUNK_ALLOC;
+
+	if (chunk->size >= size + 64) {
+		/* split into two */
+		split_chunk(chunk, size);
+	}
+	int zeroed = chunk->zeroed;
+	chunk->zeroed = 0;
+	return zeroed;
+}
+
 void *remotethread_malloc(size_t size, const void *caller)
 {
 	UNUSED(caller);
-	size = round_up(size + sizeof(struct chunk), 64);
+	size = chunk_len(size);
+	if (size == 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
 	struct chunk *chunk = find_free_chunk(size);
 	if (chunk == NULL)
 		return NULL;
-	chunk->status = CHUNK_ALLOC;
+	take_chunk(chunk, size);
+	return chunk + 1;
+}
 
-	if (chunk->size >= size + 64) {
-		/* split into two */
-		split_chunk(chunk, size);
+void *remotethread_calloc(size_t nmemb, size_t size, const void *caller)
+{
+	UNUSED(caller);
+	size_t len = 0;
+	if (size == 0 || nmemb <= (size_t) -1 / size)
+		len = chunk_len(nmemb * size);
+	if (len == 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct chunk *chunk = find_free_chunk(len);
+	if (chunk == NULL)
+		return NULL;
+	if (!take_chunk(chunk, len)) {
+		/* fresh pages and zeroed free chunks can be used as is */
+		memset(chunk + 1, 0, nmemb * size);
+	}
+	return chunk + 1;
+}
+
+void *remotethread_memalign(size_t alignment, size_t size,
+			    const void *caller)
+{
+	if (alignment & (alignment - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (alignment <= sizeof(void *))
+		return remotethread_malloc(size, caller);
+
+	/*
+	 * Find a chunk with room for the alignment and a free chunk in
+	 * front of the aligned one, of at least 64 bytes. The end of the
+	 * aligned chunk is kept aligned to 64 bytes like all other chunks.
+	 */
+	size_t len = chunk_len(size);
+	if (len == 0 || alignment > (size_t) -1 - len - 128) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	struct chunk *chunk = find_free_chunk(len + alignment + 128);
+	if (chunk == NULL)
+		return NULL;
+
+	char *ptr = (char *) round_up((size_t) (chunk + 1), alignment);
+	size_t gap = ptr - (char *) (chunk + 1);
+	if (gap > 0 && gap < 64) {
+		size_t step = alignment < 64 ? 64 : alignment;
+		ptr += step;
+		gap += step;
 	}
+	if (gap > 0)
+		chunk = split_chunk(chunk, gap);
+
+	len = round_up((size_t) ptr + size, 64) - (size_t) chunk;
+	take_chunk(chunk, len);
 	return chunk + 1;
 }
 
+int remotethread_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+	void *ptr = remotethread_memalign(alignment, size, NULL);
+	if (ptr == NULL)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+size_t remotethread_malloc_usable_size(void *ptr)
+{
+	if (ptr == NULL)
+		return 0;
+	struct chunk *chunk = (struct chunk *) ptr - 1;
+	assert(chunk->status == CHUNK_ALLOC);
+	return chunk->size - sizeof(struct chunk);
+}
+
 void remotethread_free(void *ptr, const void *caller)
 {
 	UNUSED(caller);
@@ -227,11 +611,20 @@ void *remotethread_realloc(void *ptr, size_t new_size, const void *caller)
 	if (ptr == NULL)
 		return remotethread_malloc(new_size, caller);
 
-	new_size = round_up(new_size + sizeof(struct chunk), 64);
+	size_t len = chunk_len(new_size);
+	if (len == 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
 	struct chunk *chunk = (struct chunk *) ptr - 1;
 	assert(chunk->status == CHUNK_ALLOC);
 
-	if (new_size < chunk->size) {
+	/* an aligned chunk starts anywhere, but it ends 64-byte aligned */
+	size_t offset = (size_t) ptr & 63;
+	new_size = round_up(offset + new_size, 64) - offset
+		+ sizeof(struct chunk);
+
+	if (new_size <= chunk->size) {
 		/* shrink */
 		if (chunk->size >= new_size + 64) {
 			/* split into two */
@@ -267,17 +660,14 @@ void *remotethread_realloc(void *ptr, size_t new_size, const void *caller)
 			}
 		} else {
 			/* does not fit, we have to copy */
-			struct chunk *new_chunk = find_free_chunk(new_size);
+			struct chunk *new_chunk = find_free_chunk(len);
 			if (new_chunk == NULL)
 				return NULL;
-			new_chunk->status = CHUNK_ALLOC;
-
-			if (new_chunk->size >= new_size + 64) {
-				/* split into two */
-				split_chunk(new_chunk, new_size);
-			}
+			take_chunk(new_chunk, len);
+			/* the end of an aligned chunk may be rounded up */
+			size_t copy = chunk->size < len ? chunk->size : len;
 			memcpy(new_chunk + 1, chunk + 1,
-				chunk->size - sizeof(struct chunk));
+				copy - sizeof(struct chunk));
 			chunk->status = CHUNK_FREE;
 			merge_free_chunks(chunk);
 			chunk = new_chunk;
@@ -286,308 +676,3361 @@ void *remotethread_realloc(void *ptr, size_t new_size, const void *caller)
 	return chunk + 1;
 }
 
-struct zlib_chunk {
+/*
+ * Buffers for zlib and the compressed heaps are mapped directly, so that
+ * they do not end up in the heap when malloc is hooked to it.
+ */
+struct buffer {
 	size_t size;
 };
 
+/* zlib takes at most this much at a time */
+#define ZLIB_CHUNK	(1 << 30)
+
+static void *alloc_buffer(size_t len)
+{
+	size_t size = len + sizeof(struct buffer);
+	struct buffer *buf = mmap(NULL, size, PROT_READ|PROT_WRITE,
+				  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+	buf->size = size;
+	return buf + 1;
+}
+
+static void free_buffer(void *ptr)
+{
+	struct buffer *buf = (struct buffer *) ptr - 1;
+	munmap(buf, buf->size);
+}
+
 static void *zlib_alloc(void *opaque, unsigned int nitems, unsigned int isize)
 {
 	UNUSED(opaque);
-	size_t size = nitems * isize + sizeof(struct zlib_chunk);
-	struct zlib_chunk *chunk = mmap(NULL, size, PROT_READ|PROT_WRITE,
-		    MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
-	if (chunk == NULL)
-		return NULL;
-	chunk->size = size;
-	return chunk + 1;
+	return alloc_buffer((size_t) nitems * isize);
 }
 
 static void zlib_free(void *opaque, void *ptr)
 {
 	UNUSED(opaque);
-	struct zlib_chunk *chunk = (struct zlib_chunk *) ptr - 1;
-	munmap(chunk, chunk->size);
+	free_buffer(ptr);
 }
 
-struct remotethread *call_remotethread(remotethread_func_t func,
-				       const void *param, size_t param_len)
+static size_t min_size(size_t a, size_t b)
 {
-	if (num_servers == 0) {
-		static int warned = 0;
-		if (warned == 0) {
-			warning("no servers defined! use --remotethread [ip]\n");
-			warned = 1;
-		}
-		return NULL;
-	}
+	return a < b ? a : b;
+}
 
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0) {
-		warning("socket() failed (%s)\n", strerror(errno));
+/* compresses the first len bytes of the heap */
+static void *deflate_heap(size_t len, size_t *compr_len)
+{
+	z_stream strm;
+	strm.zalloc = zlib_alloc;
+	strm.zfree = zlib_free;
+	if (deflateInit(&strm, compress_level) != Z_OK) {
+		warning("Unable to initialize deflate\n");
 		return NULL;
 	}
 
-	/* connect to a random server */
-	struct sockaddr_in sin;
-	sin.sin_family = AF_INET;
-	sin.sin_addr = servers[rand() % num_servers];
-	sin.sin_port = htons(DEFAULT_PORT);
-	if (connect(fd, (struct sockaddr *) &sin, sizeof sin)) {
-		warning("connect() failed (%s)\n", strerror(errno));
-		goto err;
-	}
-
-	size_t binary_len;
-	void *binary = read_file(my_binary, &binary_len);
-	if (binary == NULL)
-		goto err;
-
-	struct hello hello;
-	hello.magic = htonl(MAGIC);
-	hello.binary_len = htonl(binary_len);
-	if (write_all(fd, &hello, sizeof hello)) {
-		free(binary);
-		goto err;
-	}
-	if (write_all(fd, binary, binary_len)) {
-		free(binary);
-		goto err;
-	}
-	free(binary);
-
-	/* create copy of the parameters */
-	void *param_buf = remotethread_malloc(param_len, NULL);
-	if (param_buf == NULL) {
+	size_t bound = deflateBound(&strm, len);
+	char *buf = alloc_buffer(bound);
+	if (buf == NULL) {
 		warning("Out of memory\n");
-		goto err;
+		deflateEnd(&strm);
+		return NULL;
 	}
-	memcpy(param_buf, param, param_len);
 
-	/* zero the memory used by free chunks */
-	struct chunk *chunk = first_chunk;
-	while (chunk != (struct chunk *) current_end) {
-		if (chunk->status == CHUNK_FREE)
-			memset(chunk + 1, 0, chunk->size - sizeof(struct chunk));
-		chunk = (struct chunk *) ((char *) chunk + chunk->size);
-	}
+	const char *in = (const char *) ALLOC_BEGIN;
+	size_t in_pos = 0, out_pos = 0;
+	int status;
+	do {
+		size_t in_chunk = min_size(len - in_pos, ZLIB_CHUNK);
+		size_t out_chunk = min_size(bound - out_pos, ZLIB_CHUNK);
+		strm.next_in = (Bytef *) in + in_pos;
+		strm.avail_in = in_chunk;
+		strm.next_out = (Bytef *) buf + out_pos;
+		strm.avail_out = out_chunk;
+		status = deflate(&strm, in_pos + in_chunk == len ?
+				 Z_FINISH : Z_NO_FLUSH);
+		in_pos += in_chunk - strm.avail_in;
+		out_pos += out_chunk - strm.avail_out;
+	} while (status == Z_OK);
+	deflateEnd(&strm);
 
-	size_t alloc_len = current_end - (char *) ALLOC_BEGIN;
+	if (status != Z_STREAM_END) {
+		warning("deflate failed (%d)\n", status);
+		free_buffer(buf);
+		return NULL;
+	}
+	*compr_len = out_pos;
+	return buf;
+}
 
-	/* compress the allocation area */
+/* decompresses into the heap, the image may be shorter than the heap */
+static int inflate_heap(const void *compr, size_t compr_len, size_t len)
+{
 	z_stream strm;
 	strm.zalloc = zlib_alloc;
 	strm.zfree = zlib_free;
-	if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
-		warning("Unable to initialize deflate\n");
-		remotethread_free(param_buf, NULL);
-		goto err;
-	}
-
-	void *compr_alloc = zlib_alloc(NULL, 1, alloc_len * 2);
-	if (compr_alloc == NULL) {
-		warning("Out of memory\n");
-		remotethread_free(param_buf, NULL);
-		deflateEnd(&strm);
-		goto err;
-	}
-	strm.next_in = (void *) ALLOC_BEGIN;
-	strm.avail_in = alloc_len;
-	strm.next_out = compr_alloc;
-	strm.avail_out = alloc_len * 2;
-	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
-		warning("deflate failed\n");
-		remotethread_free(param_buf, NULL);
-		deflateEnd(&strm);
-		goto err;
+	strm.next_in = Z_NULL;
+	strm.avail_in = 0;
+	if (inflateInit(&strm) != Z_OK) {
+		warning("Unable to initialize inflate\n");
+		return -1;
 	}
-	assert(strm.avail_in == 0);
-	size_t alloc_compr_len = alloc_len * 2 - strm.avail_out;
-	deflateEnd(&strm);
 
-	remotethread_free(param_buf, NULL);
+	char *out = (char *) ALLOC_BEGIN;
+	size_t in_pos = 0, out_pos = 0;
+	int status;
+	do {
+		size_t in_chunk = min_size(compr_len - in_pos, ZLIB_CHUNK);
+		size_t out_chunk = min_size(len - out_pos, ZLIB_CHUNK);
+		strm.next_in = (Bytef *) compr + in_pos;
+		strm.avail_in = in_chunk;
+		strm.next_out = (Bytef *) out + out_pos;
+		strm.avail_out = out_chunk;
+		status = inflate(&strm, Z_NO_FLUSH);
+		in_pos += in_chunk - strm.avail_in;
+		out_pos += out_chunk - strm.avail_out;
+	} while (status == Z_OK);
+	inflateEnd(&strm);
 
-	struct call call;
-	call.alloc_len = htonl(alloc_len);
-	call.alloc_compr_len = htonl(alloc_compr_len);
-	call.param_len = htonl(param_len);
-	call.param = (uint64_t) param_buf;
-	call.eip = (uint64_t) func;
-
-	if (write_all(fd, &call, sizeof call)) {
-		zlib_free(NULL, compr_alloc);
-		goto err;
-	}
-	if (write_all(fd, compr_alloc, alloc_compr_len)) {
-		zlib_free(NULL, compr_alloc);
-		goto err;
+	if (status != Z_STREAM_END || in_pos != compr_len) {
+		warning("Unable to inflate alloc (%d)\n", status);
+		return -1;
 	}
-	zlib_free(NULL, compr_alloc);
+	return 0;
+}
 
-	struct remotethread *rt = calloc(1, sizeof *rt);
-	rt->fd = fd;
-	return rt;
+static void begin_phase(struct remotethread *rt, int phase)
+{
+	rt->begin[phase] = now_ns();
+}
 
- err:
-	close(fd);
-	return NULL;
+static void end_phase(struct remotethread *rt, int phase)
+{
+	rt->phase[phase] = now_ns() - rt->begin[phase];
 }
 
-void *poll_remotethread(struct remotethread *rt, size_t *reply_len)
+static void finish_call(struct remotethread *rt, int ok)
 {
-	if (rt->reply_len == 0) {
-		if (bytes_available(rt->fd) < sizeof(struct reply))
-			return RT_EAGAIN;
-		if (read_all(rt->fd, &rt->reply, sizeof(struct reply)))
-			return NULL;
+	struct remotethread_stats *st = &stats[rt->server];
+	if (rt->done)
+		return;
+	rt->done = 1;
+	if (!ok) {
+		st->errors++;
+		return;
+	}
 
-		if (rt->reply.status == STATUS_ERROR) {
-			warning("server returned an error\n");
-			return NULL;
-		}
+	/*
+	 * Place the remote phases on our timeline: the server has the binary
+	 * once we have sent it, and the slave has the heap once we have
+	 * sent it.
+	 */
+	int i;
+	for (i = 0; i < NUM_REMOTE_PHASES; ++i)
+		rt->phase[RT_PHASE_RECV_BINARY + i] = be64toh(rt->reply.times[i]);
+	rt->begin[RT_PHASE_RECV_BINARY] = rt->begin[RT_PHASE_SEND_BINARY]
+		+ rt->phase[RT_PHASE_SEND_BINARY]
+		- rt->phase[RT_PHASE_RECV_BINARY];
+	rt->begin[RT_PHASE_EXEC] = rt->begin[RT_PHASE_SEND_BINARY]
+		+ rt->phase[RT_PHASE_SEND_BINARY];
+	rt->begin[RT_PHASE_RECV_HEAP] = rt->begin[RT_PHASE_SEND_HEAP]
+		+ rt->phase[RT_PHASE_SEND_HEAP]
+		- rt->phase[RT_PHASE_RECV_HEAP];
+	rt->begin[RT_PHASE_INFLATE] = rt->begin[RT_PHASE_SEND_HEAP]
+		+ rt->phase[RT_PHASE_SEND_HEAP];
+	rt->begin[RT_PHASE_FUNC] = rt->begin[RT_PHASE_INFLATE]
+		+ rt->phase[RT_PHASE_INFLATE];
 
-		rt->reply_len = ntohl(rt->reply.reply_len);
-		rt->pos = 0;
-		rt->buf = malloc(rt->reply_len);
-		if (rt->buf == NULL) {
-			warning("Out of memory\n");
-			return NULL;
+	st->reply_bytes += rt->reply_len;
+	for (i = 0; i < RT_NUM_PHASES; ++i) {
+		st->phase_time[i] += rt->phase[i];
+		if (rt->phase[i] > st->phase_max[i])
+			st->phase_max[i] = rt->phase[i];
+	}
+
+	if (trace_fname == NULL)
+		return;
+	if (trace_len == trace_size) {
+		size_t size = trace_size ? trace_size * 2 : 256;
+		struct trace_call *buf = realloc(trace, size * sizeof *buf);
+		if (buf == NULL)
+			return;
+		trace = buf;
+		trace_size = size;
+	}
+	struct trace_call *tc = &trace[trace_len++];
+	tc->server = rt->server;
+	memcpy(tc->begin, rt->begin, sizeof tc->begin);
+	memcpy(tc->phase, rt->phase, sizeof tc->phase);
+}
+
+/* the time a call may take on the server, 0 if not limited */
+static uint32_t call_timeout_ms(uint64_t timeout)
+{
+	if (slave_deadline) {
+		uint64_t now = now_ns();
+		timeout = slave_deadline > now ? slave_deadline - now : 0;
+		return timeout / 1000000 + 1;
+	}
+	return (timeout + 999999) / 1000000;
+}
+
+/*
+ * Connects to a server and greets it, the welcome is read later with
+ * read_welcome(). The server reserves memory for the binary and a heap
+ * of alloc_len bytes. The key is a cache key or the id of a published
+ * heap, depending on the flags. The server kills the call after
+ * timeout_ms, unless it is 0.
+ */
+static int open_call(const struct sockaddr_in *sin, size_t binary_len,
+		     size_t alloc_len, uint32_t flags, const uint64_t *key,
+		     uint32_t timeout_ms)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		warning("socket() failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *) sin, sizeof *sin)) {
+		warning("connect() failed (%s)\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* we do our own framing */
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	/* the keepalive probes serve as heartbeats while a task runs */
+	int idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL;
+	int count = KEEPALIVE_COUNT;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one);
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof interval);
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof count);
+
+	/* the server answers while we prepare the heap */
+	struct hello hello;
+	hello.magic = htonl(MAGIC);
+	hello.version = htonl(PROTO_VERSION);
+	hello.binary_len = htobe64(binary_len);
+	hello.flags = htonl(flags);
+	hello.key[0] = htobe64(key ? key[0] : 0);
+	hello.key[1] = htobe64(key ? key[1] : 0);
+	hello.alloc_len = htobe64(alloc_len);
+	hello.timeout_ms = htonl(timeout_ms);
+	if (write_all(fd, &hello, sizeof hello)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * zero the memory used by free chunks. The trailing free chunk is not
+ * shipped at all except for its header, the slave gets fresh zero pages
+ * for it.
+ */
+static void zero_image(struct image *img, struct remotethread *rt)
+{
+	begin_phase(rt, RT_PHASE_ZERO);
+	img->alloc_len = heap_size();
+	img->len = img->alloc_len;
+	img->compr = NULL;
+	if (last_chunk == NULL) {
+		/* nothing has been allocated yet */
+		end_phase(rt, RT_PHASE_ZERO);
+		return;
+	}
+	if (last_chunk->status == CHUNK_FREE)
+		img->len = (char *) (last_chunk + 1) - (char *) ALLOC_BEGIN;
+
+	struct chunk *chunk = first_chunk;
+	while (chunk != last_chunk) {
+		if (chunk->status == CHUNK_FREE && !chunk->zeroed) {
+			memset(chunk + 1, 0, chunk->size - sizeof(struct chunk));
+			chunk->zeroed = 1;
+		}
+		chunk = (struct chunk *) ((char *) chunk + chunk->size);
+	}
+	end_phase(rt, RT_PHASE_ZERO);
+}
+
+/* compresses the heap image unless compression is disabled */
+static int compress_image(struct image *img, struct remotethread *rt)
+{
+	begin_phase(rt, RT_PHASE_DEFLATE);
+	img->data = (const void *) ALLOC_BEGIN;
+	img->data_len = img->len;
+	if (compress_level != 0) {
+		img->compr = deflate_heap(img->len, &img->data_len);
+		if (img->compr == NULL)
+			return -1;
+		img->data = img->compr;
+	}
+	end_phase(rt, RT_PHASE_DEFLATE);
+	return 0;
+}
+
+static int prepare_image(struct image *img, struct remotethread *rt)
+{
+	zero_image(img, rt);
+	return compress_image(img, rt);
+}
+
+/* hashes the binary once */
+static int get_binary_hash(void)
+{
+	if (have_binary_hash)
+		return 0;
+	struct stat stbuf;
+	if (binary_fd < 0 || fstat(binary_fd, &stbuf))
+		return -1;
+	void *map = mmap(NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE,
+			 binary_fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	memset(binary_hash, 0, sizeof binary_hash);
+	hash128(map, stbuf.st_size, binary_hash);
+	munmap(map, stbuf.st_size);
+	have_binary_hash = 1;
+	return 0;
+}
+
+/* forgets which pages have been written, 0 on success */
+static int clear_soft_dirty(void)
+{
+	return write(clear_refs_fd, "4", 1) == 1 ? 0 : -1;
+}
+
+static int page_written(const void *addr, int *written)
+{
+	uint64_t entry;
+	off_t off = (uintptr_t) addr / PAGE_SIZE * sizeof entry;
+	if (pread(pagemap_fd, &entry, sizeof entry, off) != sizeof entry)
+		return -1;
+	*written = (entry & PM_SOFT_DIRTY) != 0;
+	return 0;
+}
+
+/* the kernel marks written pages only with CONFIG_MEM_SOFT_DIRTY */
+static void probe_soft_dirty(void)
+{
+	static volatile char probe;
+	int written = 0;
+	soft_dirty = 0;
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (pagemap_fd >= 0 && clear_refs_fd >= 0 && clear_soft_dirty() == 0) {
+		probe = 1;
+		soft_dirty = page_written((const void *) &probe, &written) == 0
+			&& written;
+	}
+	if (!soft_dirty) {
+		if (pagemap_fd >= 0)
+			close(pagemap_fd);
+		if (clear_refs_fd >= 0)
+			close(clear_refs_fd);
+		pagemap_fd = -1;
+		clear_refs_fd = -1;
+	}
+}
+
+/* marks the blocks with pages written since the last hash */
+static int find_written(char *dirty, size_t len)
+{
+	uint64_t entries[PAGEMAP_BATCH];
+	size_t num_pages = (len + PAGE_SIZE - 1) / PAGE_SIZE, page = 0;
+	off_t off = ALLOC_BEGIN / PAGE_SIZE * sizeof *entries;
+	while (page < num_pages) {
+		size_t n = num_pages - page, i;
+		if (n > PAGEMAP_BATCH)
+			n = PAGEMAP_BATCH;
+		if (pread(pagemap_fd, entries, n * sizeof *entries,
+			  off + page * sizeof *entries)
+		    != (ssize_t) (n * sizeof *entries))
+			return -1;
+		for (i = 0; i < n; ++i) {
+			if (entries[i] & PM_SOFT_DIRTY)
+				dirty[(page + i) * PAGE_SIZE / HASH_BLOCK] = 1;
+		}
+		page += n;
+	}
+	return 0;
+}
+
+/*
+ * Hashes the first len bytes of the heap. The hash of each block is
+ * kept, and where the kernel tracks written pages only the blocks
+ * written since the last call are hashed again.
+ */
+static int hash_heap(size_t len, uint64_t *key)
+{
+	size_t num = (len + HASH_BLOCK - 1) / HASH_BLOCK, i;
+	if (num > num_block_hashes) {
+		uint64_t (*hashes)[2] = realloc(block_hashes,
+						num * sizeof *hashes);
+		if (hashes == NULL)
+			return -1;
+		block_hashes = hashes;
+		num_block_hashes = num;
+	}
+	char *dirty = malloc(num + 1);
+	if (dirty == NULL)
+		return -1;
+
+	if (soft_dirty < 0)
+		probe_soft_dirty();
+	if (soft_dirty && hashed_len) {
+		/* and the blocks that have grown or shrunk */
+		size_t old_num = (hashed_len + HASH_BLOCK - 1) / HASH_BLOCK;
+		memset(dirty, 0, num);
+		for (i = old_num; i < num; ++i)
+			dirty[i] = 1;
+		if (len != hashed_len)
+			dirty[(len < hashed_len ? len : hashed_len)
+			      / HASH_BLOCK] = 1;
+		if (find_written(dirty, len))
+			memset(dirty, 1, num);
+	} else {
+		memset(dirty, 1, num);
+	}
+	if (soft_dirty && clear_soft_dirty())
+		soft_dirty = 0;
+
+	for (i = 0; i < num; ++i) {
+		if (!dirty[i])
+			continue;
+		size_t begin = i * HASH_BLOCK;
+		size_t block_len = len - begin < HASH_BLOCK ? len - begin
+			: HASH_BLOCK;
+		block_hashes[i][0] = 0;
+		block_hashes[i][1] = 0;
+		hash128((const char *) ALLOC_BEGIN + begin, block_len,
+			block_hashes[i]);
+	}
+	free(dirty);
+	hash128(block_hashes, num * sizeof *block_hashes, key);
+	hashed_len = soft_dirty ? len : 0;
+	return 0;
+}
+
+/*
+ * The key of a call covers everything the reply may depend on: the
+ * binary, the function, the parameters and the heap image. The image must
+ * have been zeroed.
+ */
+static int call_key(const struct remotethread_task *task, const void *param,
+		    const struct image *img, uint64_t *key)
+{
+	if (get_binary_hash())
+		return -1;
+
+	uint64_t call[4];
+	call[0] = (uint64_t) task->func - load_bias();
+	call[1] = (uint64_t) param;
+	call[2] = task->param_len;
+	call[3] = img->alloc_len;
+	memcpy(key, binary_hash, sizeof binary_hash);
+	hash128(call, sizeof call, key);
+	hash128(task->param, task->param_len, key);
+
+	/* whether the trailing free chunk is zeroed depends on the history */
+	size_t len = img->len;
+	if (len < img->alloc_len)
+		len -= sizeof(struct chunk) - offsetof(struct chunk, zeroed);
+	return hash_heap(len, key);
+}
+
+static void cache_unlink(struct cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache_tail = e->prev;
+}
+
+static void cache_push(struct cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache_head;
+	if (cache_head)
+		cache_head->prev = e;
+	else
+		cache_tail = e;
+	cache_head = e;
+}
+
+static struct cache_entry *cache_lookup(const uint64_t *key)
+{
+	struct cache_entry *e = cache_buckets[key[0] % CACHE_BUCKETS];
+	while (e && (e->key[0] != key[0] || e->key[1] != key[1]))
+		e = e->chain;
+	if (e) {
+		cache_unlink(e);
+		cache_push(e);
+	}
+	return e;
+}
+
+/* the least recently used replies are evicted to make room */
+static void cache_insert(const uint64_t *key, const void *data, size_t len)
+{
+	size_t size = sizeof(struct cache_entry) + len;
+	if (size > cache_limit || cache_lookup(key))
+		return;
+	while (cache_size + size > cache_limit) {
+		struct cache_entry *e = cache_tail;
+		struct cache_entry **p = &cache_buckets[e->key[0] % CACHE_BUCKETS];
+		while (*p != e)
+			p = &(*p)->chain;
+		*p = e->chain;
+		cache_unlink(e);
+		cache_size -= sizeof *e + e->len;
+		free(e);
+	}
+
+	struct cache_entry *e = malloc(size);
+	if (e == NULL)
+		return;
+	memcpy(e->key, key, sizeof e->key);
+	e->len = len;
+	memcpy(e->data, data, len);
+	e->chain = cache_buckets[key[0] % CACHE_BUCKETS];
+	cache_buckets[key[0] % CACHE_BUCKETS] = e;
+	cache_push(e);
+	cache_size += size;
+}
+
+/* the call that starts the task of a relay entry */
+static void relay_call(struct call *call, const struct relay *r)
+{
+	call->eip = r->eip;
+	call->task = r->task;
+	call->param = r->param;
+	call->param_len = r->param_len;
+	call->flags = 0;
+}
+
+/* returns one of WELCOME_*, or -1 if the call was rejected */
+static int read_welcome(int fd)
+{
+	struct welcome welcome;
+	if (read_all(fd, &welcome, sizeof welcome)
+	    || ntohl(welcome.magic) != MAGIC) {
+		warning("no answer from server, old protocol version?\n");
+		return -1;
+	}
+	if (welcome.status == STATUS_CACHED)
+		return WELCOME_CACHED;
+	if (welcome.status == STATUS_BUSY)
+		return WELCOME_BUSY;
+	if (welcome.status != STATUS_OK) {
+		warning("server rejected the call (protocol version %u, "
+			"ours is %u)\n", ntohl(welcome.version), PROTO_VERSION);
+		return -1;
+	}
+	return WELCOME_OK;
+}
+
+/* the first server from server on that is not being avoided */
+static int next_server(int server)
+{
+	uint64_t now = now_ns();
+	int i;
+	for (i = 0; i < num_servers; ++i) {
+		int s = (server + i) % num_servers;
+		if (avoid_until[s] <= now)
+			return s;
+	}
+	return server % num_servers;
+}
+
+/*
+ * Sends the binary, the call followed by its relays, the heap image and
+ * the parameters if they are not in the heap. The flags of the call are
+ * completed here. The time when the binary has been sent is stored in
+ * binary_sent.
+ */
+static int send_call(int fd, size_t binary_len, struct call *call,
+		     const struct relay *relays, int num_relays,
+		     const struct image *img, const struct iovec *param_iov,
+		     int param_iovcnt, uint64_t *binary_sent)
+{
+	/* coalesce the end of the binary with the call header */
+	int one = 1, zero = 0;
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &one, sizeof one);
+
+	if (send_file(fd, binary_fd, binary_len))
+		return -1;
+	if (binary_sent)
+		*binary_sent = now_ns();
+
+	uint32_t flags = ntohl(call->flags);
+	if (img->compr == NULL)
+		flags |= CALL_RAW_HEAP;
+	if (param_iovcnt)
+		flags |= CALL_INLINE_PARAM;
+	call->alloc_len = htobe64(img->alloc_len);
+	call->alloc_compr_len = htobe64(img->data_len);
+	call->flags = htonl(flags);
+	call->num_relays = htonl(num_relays);
+
+	struct iovec iov[3 + MAX_PARAM_IOV];
+	iov[0].iov_base = call;
+	iov[0].iov_len = sizeof *call;
+	iov[1].iov_base = (void *) relays;
+	iov[1].iov_len = num_relays * sizeof *relays;
+	iov[2].iov_base = (void *) img->data;
+	iov[2].iov_len = img->data_len;
+	memcpy(iov + 3, param_iov, param_iovcnt * sizeof *iov);
+	if (img->compr) {
+		if (writev_all(fd, iov, 3 + param_iovcnt))
+			return -1;
+	} else {
+		/* the kernel reads the heap pages directly */
+		if (writev_all(fd, iov, 2)
+		    || send_zerocopy(fd, img->data, img->data_len)
+		    || writev_all(fd, iov + 3, param_iovcnt))
+			return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof zero);
+	return 0;
+}
+
+/* splits tasks into at most BROADCAST_FANOUT contiguous subtrees */
+static int split_tasks(int num, int *starts)
+{
+	int groups = num < BROADCAST_FANOUT ? num : BROADCAST_FANOUT;
+	int i;
+	if (groups == 0)
+		return 0;
+	for (i = 0; i <= groups; ++i)
+		starts[i] = (int) ((long) num * i / groups);
+	return groups;
+}
+
+/* the launch tree of a submission, laid out in preorder */
+struct tree {
+	const struct remotethread_task *tasks;
+	struct remotethread **threads;
+	void **param_bufs;
+	int *first_dep;
+	int *next_dep;
+	int *roots;
+	struct relay *relays;
+	int pos;
+};
+
+static void put_entry(struct tree *t, int task, uint32_t flags)
+{
+	struct relay *r = &t->relays[t->pos++];
+	const struct sockaddr_in *sin = &servers[t->threads[task]->server];
+	r->addr = sin->sin_addr.s_addr;
+	r->port = sin->sin_port;
+	r->task = htonl(task);
+	r->flags = htonl(flags);
+	r->eip = htobe64((uint64_t) t->tasks[task].func - load_bias());
+	r->param = htobe64((uint64_t) t->param_bufs[task]);
+	r->param_len = htobe64(t->tasks[task].param_len);
+}
+
+/* a chained task and the tasks that follow it */
+static void put_chain(struct tree *t, int task)
+{
+	int pos = t->pos;
+	int dep;
+	put_entry(t, task, RELAY_CHAINED);
+	for (dep = t->first_dep[task]; dep >= 0; dep = t->next_dep[dep])
+		put_chain(t, dep);
+	t->relays[pos].num_below = htonl(t->pos - pos - 1);
+}
+
+/*
+ * The first of the roots relays the heap to the rest of them, split into
+ * subtrees, and starts the tasks that follow it.
+ */
+static void put_roots(struct tree *t, int begin, int end)
+{
+	int starts[BROADCAST_FANOUT + 1];
+	int pos = t->pos;
+	int dep, g;
+	put_entry(t, t->roots[begin], 0);
+	for (dep = t->first_dep[t->roots[begin]]; dep >= 0;
+	     dep = t->next_dep[dep])
+		put_chain(t, dep);
+	int groups = split_tasks(end - begin - 1, starts);
+	for (g = 0; g < groups; ++g)
+		put_roots(t, begin + 1 + starts[g], begin + 1 + starts[g + 1]);
+	t->relays[pos].num_below = htonl(t->pos - pos - 1);
+}
+
+static void put_batch(struct batch *b)
+{
+	if (--b->refs == 0) {
+		free(b->tasks);
+		free(b);
+	}
+}
+
+static void put_payload(struct remotethread *rt)
+{
+	struct payload *p = rt->payload;
+	rt->payload = NULL;
+	if (p && --p->refs == 0) {
+		if (p->img.compr)
+			free_buffer(p->img.compr);
+		free(p);
+	}
+}
+
+/* the connection is closed with its last task */
+static void detach_task(struct remotethread *rt)
+{
+	struct conn *c = rt->conn;
+	if (c == NULL)
+		return;
+	struct batch *b = c->batch;
+	rt->conn = NULL;
+	b->tasks[rt->task] = NULL;
+	if (c->target == rt) {
+		c->discard = rt->reply_len - rt->pos;
+		c->target = NULL;
+	}
+	if (--c->refs == 0) {
+		if (c->fd >= 0)
+			close(c->fd);
+		free(c);
+	}
+	put_batch(b);
+}
+
+/*
+ * A task that has failed is sent again after a backoff, to another
+ * server, as long as it has retries left.
+ */
+static void retry_task(struct remotethread *rt)
+{
+	struct conn *c = rt->conn;
+	if (c && c->target == rt) {
+		c->discard = rt->reply_len - rt->pos;
+		c->target = NULL;
+	}
+	free(rt->buf);
+	rt->buf = NULL;
+	if (rt->payload == NULL || rt->retries >= max_retries) {
+		rt->state = TASK_FAILED;
+		put_payload(rt);
+		return;
+	}
+	uint64_t now = now_ns();
+	avoid_until[rt->server] = now + BUSY_BACKOFF_NS;
+	rt->retry_at = now + ((uint64_t) RETRY_BACKOFF_NS << rt->retries);
+	rt->retries++;
+	stats[rt->server].retries++;
+	rt->state = TASK_RETRY;
+}
+
+int chain_remotethread(const struct remotethread_task *tasks, int num,
+		       struct remotethread **threads)
+{
+	if (num_servers == 0) {
+		static int warned = 0;
+		if (warned == 0) {
+			warning("no servers defined! use --remotethread [ip]\n");
+			warned = 1;
+		}
+		return -1;
+	}
+	if (num <= 0 || (uint32_t) num >= TASK_NONE) {
+		warning("invalid number of tasks\n");
+		return -1;
+	}
+	int i, g, sent = 0, num_roots = 0;
+	for (i = 0; i < num; ++i) {
+		if (tasks[i].after < -1 || tasks[i].after >= i) {
+			warning("task %d must follow an earlier task\n", i);
+			return -1;
+		}
+	}
+
+	struct conn *conns[BROADCAST_FANOUT];
+	int starts[BROADCAST_FANOUT + 1];
+	int ends[BROADCAST_FANOUT];
+	struct image img;
+	struct tree t;
+	struct batch *batch = calloc(1, sizeof *batch);
+	memset(&t, 0, sizeof t);
+	memset(conns, 0, sizeof conns);
+	memset(threads, 0, num * sizeof *threads);
+	img.compr = NULL;
+	t.tasks = tasks;
+	t.threads = threads;
+	t.param_bufs = calloc(num, sizeof *t.param_bufs);
+	t.first_dep = malloc(num * sizeof *t.first_dep);
+	t.next_dep = malloc(num * sizeof *t.next_dep);
+	t.roots = malloc(num * sizeof *t.roots);
+	t.relays = calloc(num, sizeof *t.relays);
+	if (batch == NULL || t.param_bufs == NULL || t.first_dep == NULL
+	    || t.next_dep == NULL || t.roots == NULL || t.relays == NULL)
+		goto oom;
+	batch->num_tasks = num;
+	batch->tasks = calloc(num, sizeof *batch->tasks);
+	if (batch->tasks == NULL)
+		goto oom;
+
+	/* consecutive tasks go to consecutive servers */
+	int first_server = rand() % num_servers;
+	for (i = 0; i < num; ++i)
+		t.first_dep[i] = -1;
+	for (i = num - 1; i >= 0; --i) {
+		struct remotethread *rt = calloc(1, sizeof *rt);
+		if (rt == NULL)
+			goto oom;
+		rt->task = i;
+		rt->server = next_server(first_server + i);
+		threads[i] = rt;
+		if (tasks[i].after >= 0) {
+			t.next_dep[i] = t.first_dep[tasks[i].after];
+			t.first_dep[tasks[i].after] = i;
+		}
+	}
+	for (i = 0; i < num; ++i) {
+		if (tasks[i].after < 0)
+			t.roots[num_roots++] = i;
+	}
+	int groups = split_tasks(num_roots, starts);
+	struct remotethread *rt = threads[0];
+
+	/* the binary is sent straight from the file */
+	begin_phase(rt, RT_PHASE_READ_BINARY);
+	struct stat stbuf;
+	if (binary_fd < 0 || fstat(binary_fd, &stbuf)) {
+		warning("Unable to open %s\n", my_binary);
+		goto err;
+	}
+	size_t binary_len = stbuf.st_size;
+	end_phase(rt, RT_PHASE_READ_BINARY);
+
+	/* create copies of the parameters */
+	for (i = 0; i < num; ++i) {
+		t.param_bufs[i] = remotethread_malloc(tasks[i].param_len, NULL);
+		if (t.param_bufs[i] == NULL)
+			goto oom;
+		memcpy(t.param_bufs[i], tasks[i].param, tasks[i].param_len);
+	}
+	for (g = 0; g < groups; ++g) {
+		int pos = t.pos;
+		conns[g] = calloc(1, sizeof *conns[g]);
+		if (conns[g] == NULL)
+			goto oom;
+		conns[g]->fd = -1;
+		put_roots(&t, starts[g], starts[g + 1]);
+		ends[g] = t.pos;
+		for (i = pos; i < t.pos; ++i)
+			threads[ntohl(t.relays[i].task)]->conn = conns[g];
+	}
+
+	/* single calls are looked up before anything is sent */
+	if (caching && num == 1) {
+		zero_image(&img, rt);
+		rt->keyed = call_key(&tasks[0], t.param_bufs[0], &img,
+				     rt->key) == 0;
+		end_phase(rt, RT_PHASE_ZERO);
+		struct cache_entry *e = rt->keyed ? cache_lookup(rt->key)
+			: NULL;
+		if (e) {
+			rt->buf = malloc(e->len);
+			if (rt->buf == NULL)
+				goto oom;
+			memcpy(rt->buf, e->data, e->len);
+			rt->reply_len = e->len;
+			rt->state = TASK_READY;
+			rt->done = 1;
+			rt->conn = NULL;
+			stats[rt->server].calls++;
+			stats[rt->server].cache_hits++;
+			free(conns[0]);
+			free(batch->tasks);
+			free(batch);
+			goto out;
+		}
+	}
+
+	/* we only talk to the root of each subtree */
+	begin_phase(rt, RT_PHASE_CONNECT);
+	for (g = 0; g < groups; ++g) {
+		int server = threads[t.roots[starts[g]]]->server;
+		conns[g]->fd = open_call(&servers[server], binary_len,
+					 heap_size(), rt->keyed ? HELLO_CACHE : 0,
+					 rt->key, call_timeout_ms(timeout_ns));
+		if (conns[g]->fd >= 0)
+			stats[server].bytes_sent += sizeof(struct hello);
+	}
+	end_phase(rt, RT_PHASE_CONNECT);
+
+	/*
+	 * The image is built once for all the tasks, while the servers
+	 * answer. A keyed call waits for the answer as the server may
+	 * already have the reply.
+	 */
+	int compressed = 0;
+	if (!rt->keyed) {
+		if (prepare_image(&img, rt))
+			goto err;
+		compressed = 1;
+	}
+
+	for (g = 0; g < groups; ++g) {
+		struct conn *c = conns[g];
+		const struct relay *head = &t.relays[g ? ends[g - 1] : 0];
+		int num_relays = &t.relays[ends[g]] - head - 1;
+		struct remotethread *root = threads[ntohl(head->task)];
+		if (c->fd < 0)
+			continue;
+
+		/* a busy server redirects us to the next one */
+		int cached = read_welcome(c->fd);
+		int tries = 1;
+		while (cached == WELCOME_BUSY && tries++ < num_servers) {
+			avoid_until[root->server] = now_ns() + BUSY_BACKOFF_NS;
+			close(c->fd);
+			root->server = next_server(root->server + 1);
+			c->fd = open_call(&servers[root->server], binary_len,
+					  heap_size(),
+					  rt->keyed ? HELLO_CACHE : 0, rt->key,
+					  call_timeout_ms(timeout_ns));
+			cached = c->fd < 0 ? -1 : read_welcome(c->fd);
+		}
+		if (cached == WELCOME_BUSY) {
+			warning("all servers are busy\n");
+			cached = -1;
+		}
+		struct remotethread_stats *st = &stats[root->server];
+		if (c->fd < 0)
+			continue;
+		if (cached == WELCOME_CACHED) {
+			/* the reply is on its way */
+			root->begin[RT_PHASE_SEND_BINARY] = now_ns();
+			root->begin[RT_PHASE_SEND_HEAP] = now_ns();
+			st->cache_hits++;
+			sent++;
+			continue;
+		}
+		if (cached == WELCOME_OK && !compressed) {
+			if (compress_image(&img, rt))
+				goto err;
+			compressed = 1;
+		}
+
+		struct call call;
+		relay_call(&call, head);
+		uint64_t binary_sent;
+		begin_phase(root, RT_PHASE_SEND_BINARY);
+		if (cached < 0
+		    || send_call(c->fd, binary_len, &call, head + 1,
+				 num_relays, &img, NULL, 0, &binary_sent)) {
+			close(c->fd);
+			c->fd = -1;
+			continue;
+		}
+		root->begin[RT_PHASE_SEND_HEAP] = binary_sent;
+		root->phase[RT_PHASE_SEND_BINARY] =
+			binary_sent - root->begin[RT_PHASE_SEND_BINARY];
+		end_phase(root, RT_PHASE_SEND_HEAP);
+		st->bytes_sent += binary_len + sizeof call
+			+ num_relays * sizeof *head + img.data_len;
+		st->heap_bytes += img.len;
+		st->heap_compr_bytes += img.data_len;
+		sent++;
+	}
+	if (sent == 0)
+		goto err;
+
+	/* tasks that nothing follows may be sent again with the same image */
+	struct payload *payload = NULL;
+	if (max_retries > 0 && img.compr) {
+		payload = calloc(1, sizeof *payload);
+		if (payload) {
+			payload->img = img;
+			payload->binary_len = binary_len;
+			img.compr = NULL;
+		}
+	}
+	for (i = 0; payload && i < t.pos; ++i) {
+		struct remotethread *task = threads[ntohl(t.relays[i].task)];
+		if (tasks[task->task].after >= 0
+		    || t.first_dep[task->task] >= 0)
+			continue;
+		task->entry = t.relays[i];
+		task->entry.flags = 0;
+		task->entry.num_below = 0;
+		task->payload = payload;
+		payload->refs++;
+	}
+	if (payload && payload->refs == 0) {
+		free_buffer(payload->img.compr);
+		free(payload);
+	}
+
+	/* the tasks share the timings of the root of their subtree */
+	for (g = 0; g < groups; ++g) {
+		const struct relay *head = &t.relays[g ? ends[g - 1] : 0];
+		struct remotethread *root = threads[ntohl(head->task)];
+		conns[g]->batch = batch;
+		conns[g]->failed = conns[g]->fd < 0;
+		for (i = head - t.relays; i < ends[g]; ++i) {
+			struct remotethread *task = threads[ntohl(t.relays[i].task)];
+			memcpy(task->begin, rt->begin, sizeof task->begin);
+			memcpy(task->phase, rt->phase, sizeof task->phase);
+			task->begin[RT_PHASE_SEND_BINARY] =
+				root->begin[RT_PHASE_SEND_BINARY];
+			task->phase[RT_PHASE_SEND_BINARY] =
+				root->phase[RT_PHASE_SEND_BINARY];
+			task->begin[RT_PHASE_SEND_HEAP] =
+				root->begin[RT_PHASE_SEND_HEAP];
+			task->phase[RT_PHASE_SEND_HEAP] =
+				root->phase[RT_PHASE_SEND_HEAP];
+			task->state = TASK_PENDING;
+			stats[task->server].calls++;
+			begin_phase(task, RT_PHASE_WAIT);
+			task->timeout = timeout_ns;
+			if (timeout_ns)
+				task->deadline = now_ns() + timeout_ns;
+			if (conns[g]->failed)
+				retry_task(task);
+			conns[g]->refs++;
+		}
+	}
+	memcpy(batch->tasks, threads, num * sizeof *threads);
+	batch->refs = num;
+
+ out:
+	if (img.compr)
+		free_buffer(img.compr);
+	for (i = 0; i < num; ++i)
+		remotethread_free(t.param_bufs[i], NULL);
+	free(t.param_bufs);
+	free(t.first_dep);
+	free(t.next_dep);
+	free(t.roots);
+	free(t.relays);
+	return 0;
+
+ oom:
+	warning("Out of memory\n");
+ err:
+	for (i = 0; i < num; ++i) {
+		if (threads[i]) {
+			stats[threads[i]->server].calls++;
+			stats[threads[i]->server].errors++;
+		}
+		free(threads[i]);
+		threads[i] = NULL;
+	}
+	for (g = 0; g < BROADCAST_FANOUT; ++g) {
+		if (conns[g] && conns[g]->fd >= 0)
+			close(conns[g]->fd);
+		free(conns[g]);
+	}
+	if (img.compr)
+		free_buffer(img.compr);
+	for (i = 0; t.param_bufs && i < num; ++i)
+		remotethread_free(t.param_bufs[i], NULL);
+	if (batch)
+		free(batch->tasks);
+	free(batch);
+	free(t.param_bufs);
+	free(t.first_dep);
+	free(t.next_dep);
+	free(t.roots);
+	free(t.relays);
+	return -1;
+}
+
+int broadcast_remotethread(remotethread_func_t func,
+			   const void *const *params, const size_t *param_lens,
+			   int num, struct remotethread **threads)
+{
+	if (num <= 0) {
+		warning("invalid number of tasks\n");
+		return -1;
+	}
+	struct remotethread_task *tasks = malloc(num * sizeof *tasks);
+	if (tasks == NULL) {
+		warning("Out of memory\n");
+		return -1;
+	}
+	int i;
+	for (i = 0; i < num; ++i) {
+		tasks[i].func = func;
+		tasks[i].param = params[i];
+		tasks[i].param_len = param_lens[i];
+		tasks[i].after = -1;
+	}
+	int ret = chain_remotethread(tasks, num, threads);
+	free(tasks);
+	return ret;
+}
+
+struct remotethread *call_remotethread(remotethread_func_t func,
+				       const void *param, size_t param_len)
+{
+	struct remotethread *rt;
+	if (broadcast_remotethread(func, &param, &param_len, 1, &rt))
+		return NULL;
+	return rt;
+}
+
+/* the binary and the heap image, or the path of a checkpoint */
+static int send_heap(int fd, const struct publication *pub,
+		     size_t binary_len, const struct image *img)
+{
+	if (pub->checkpoint == NULL) {
+		struct call call;
+		memset(&call, 0, sizeof call);
+		return send_call(fd, binary_len, &call, NULL, 0, img, NULL, 0,
+				 NULL);
+	}
+	struct checkpoint cp;
+	cp.path_len = htonl(strlen(pub->checkpoint));
+	struct iovec iov[2];
+	iov[0].iov_base = &cp;
+	iov[0].iov_len = sizeof cp;
+	iov[1].iov_base = pub->checkpoint;
+	iov[1].iov_len = strlen(pub->checkpoint);
+	if (send_file(fd, binary_fd, binary_len))
+		return -1;
+	return writev_all(fd, iov, 2);
+}
+
+static void push_to(struct publication *pub, int server, size_t binary_len,
+		    const struct image *img)
+{
+	uint32_t flags = HELLO_PUBLISH | (pub->checkpoint ? HELLO_CHECKPOINT
+					  : 0);
+	int fd = open_call(&servers[server], binary_len, 0, flags, pub->id, 0);
+	struct reply reply;
+	pub->stored[server] = PUSH_FAILED;
+	if (fd < 0)
+		return;
+	if (read_welcome(fd) == WELCOME_OK
+	    && send_heap(fd, pub, binary_len, img) == 0
+	    && read_all(fd, &reply, sizeof reply) == 0
+	    && reply.status == STATUS_OK)
+		pub->stored[server] = PUSH_STORED;
+	close(fd);
+}
+
+/*
+ * Runs in a child process, which sees the heap as it was when it was
+ * forked, and pushes it to the servers at once from a child for each.
+ * The servers that are done are marked and signalled on done_fd.
+ */
+static void push_heap(struct publication *pub, int done_fd)
+{
+	struct remotethread rt;
+	struct image img;
+	struct stat stbuf;
+	memset(&rt, 0, sizeof rt);
+	if (binary_fd < 0 || fstat(binary_fd, &stbuf)) {
+		warning("Unable to open %s\n", my_binary);
+		return;
+	}
+	size_t binary_len = stbuf.st_size;
+	memset(&img, 0, sizeof img);
+	if (pub->checkpoint == NULL && prepare_image(&img, &rt))
+		return;
+
+	int i;
+	for (i = 0; i < num_servers; ++i) {
+		if (pub->stored[i] != PUSH_PENDING)
+			continue;
+		pid_t pid = fork();
+		if (pid > 0)
+			continue;
+		push_to(pub, i, binary_len, &img);
+		if (write(done_fd, "", 1) < 0)
+			warning("write() failed (%s)\n", strerror(errno));
+		if (pid == 0)
+			_exit(0);
+	}
+	while (wait(NULL) > 0)
+		;
+}
+
+/* the pushing process has exited, the servers it missed have failed */
+static void finish_push(struct publication *pub)
+{
+	int i;
+	if (pub->pid > 0)
+		waitpid(pub->pid, NULL, 0);
+	pub->pid = 0;
+	if (pub->done_fd >= 0)
+		close(pub->done_fd);
+	pub->done_fd = -1;
+	for (i = 0; i < num_servers; ++i) {
+		if (pub->stored[i] == PUSH_PENDING)
+			pub->stored[i] = PUSH_FAILED;
+	}
+}
+
+static int publish(const char *checkpoint, const int *list, int num)
+{
+	if (num_servers == 0) {
+		warning("no servers defined! use --remotethread [ip]\n");
+		return -1;
+	}
+	int i;
+	if (list == NULL)
+		num = num_servers;
+	for (i = 0; list && i < num; ++i) {
+		if (list[i] < 0 || list[i] >= num_servers) {
+			warning("invalid server %d\n", list[i]);
+			return -1;
+		}
+	}
+
+	struct publication *buf = realloc(publications,
+		(num_publications + 1) * sizeof *publications);
+	if (buf == NULL) {
+		warning("Out of memory\n");
+		return -1;
+	}
+	publications = buf;
+	struct publication *pub = &publications[num_publications];
+	memset(pub, 0, sizeof *pub);
+	if (checkpoint) {
+		pub->checkpoint = strdup(checkpoint);
+		if (pub->checkpoint == NULL) {
+			warning("Out of memory\n");
+			return -1;
+		}
+	}
+	pub->stored = mmap(NULL, num_servers, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pub->stored == MAP_FAILED) {
+		warning("mmap() failed (%s)\n", strerror(errno));
+		free(pub->checkpoint);
+		return -1;
+	}
+	memset(pub->stored, list ? PUSH_FAILED : PUSH_PENDING, num_servers);
+	for (i = 0; list && i < num; ++i)
+		pub->stored[list[i]] = PUSH_PENDING;
+
+	/* the id only needs to be unique */
+	static uint64_t counter = 0;
+	uint64_t seed[3];
+	seed[0] = getpid();
+	seed[1] = now_ns();
+	seed[2] = counter++;
+	hash128(seed, sizeof seed, pub->id);
+
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC)) {
+		warning("pipe() failed (%s)\n", strerror(errno));
+		munmap(pub->stored, num_servers);
+		free(pub->checkpoint);
+		return -1;
+	}
+	pub->pid = fork();
+	if (pub->pid == 0) {
+		close(fds[0]);
+		push_heap(pub, fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+	if (pub->pid < 0) {
+		warning("fork() failed (%s)\n", strerror(errno));
+		close(fds[0]);
+		munmap(pub->stored, num_servers);
+		free(pub->checkpoint);
+		return -1;
+	}
+	pub->done_fd = fds[0];
+	return num_publications++;
+}
+
+/*
+ * Snapshots the heap and pushes it with the binary to the given servers,
+ * or all servers if list is NULL, in the background. Returns a version
+ * for call_published_remotethread().
+ */
+int remotethread_publish(const int *list, int num)
+{
+	return publish(NULL, list, num);
+}
+
+/*
+ * Like remotethread_publish(), but the servers map a checkpoint that
+ * they can read themselves, and only the binary and the path are sent.
+ */
+int remotethread_publish_checkpoint(const char *fname, const int *list,
+				    int num)
+{
+	if (fname == NULL || fname[0] != '/') {
+		warning("the path of a checkpoint must be absolute\n");
+		return -1;
+	}
+	return publish(fname, list, num);
+}
+
+static struct publication *find_publication(int version)
+{
+	if (version < 0 || version >= num_publications
+	    || publications[version].stored == NULL) {
+		warning("unknown heap version %d\n", version);
+		return NULL;
+	}
+	return &publications[version];
+}
+
+/*
+ * Consecutive calls go to consecutive servers that have the heap. If
+ * none has it yet, the next server to be done is waited for.
+ */
+static int published_server(struct publication *pub)
+{
+	for (;;) {
+		int i, pending = 0;
+		for (i = 0; i < num_servers; ++i) {
+			int s = (pub->next_server + i) % num_servers;
+			if (pub->stored[s] == PUSH_STORED) {
+				pub->next_server = s + 1;
+				return s;
+			}
+			pending += pub->stored[s] == PUSH_PENDING;
+		}
+		if (!pending)
+			return -1;
+
+		char c;
+		ssize_t ret = read(pub->done_fd, &c, 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			finish_push(pub);
+	}
+}
+
+/*
+ * Runs func on a published heap. Only the call and the parameters are
+ * sent, and the heap of the call is the one that was published.
+ */
+struct remotethread *call_published_remotethread(int version,
+						 remotethread_func_t func,
+						 const void *param,
+						 size_t param_len)
+{
+	struct publication *pub = find_publication(version);
+	if (pub == NULL)
+		return NULL;
+
+	int server = published_server(pub);
+	if (server < 0) {
+		warning("heap version %d is not on any server\n", version);
+		return NULL;
+	}
+
+	struct remotethread *rt = calloc(1, sizeof *rt);
+	struct conn *c = calloc(1, sizeof *c);
+	struct batch *b = calloc(1, sizeof *b);
+	if (rt == NULL || c == NULL || b == NULL)
+		goto oom;
+	b->tasks = calloc(1, sizeof *b->tasks);
+	if (b->tasks == NULL)
+		goto oom;
+	b->tasks[0] = rt;
+	b->num_tasks = 1;
+	b->refs = 1;
+	c->batch = b;
+	c->refs = 1;
+	rt->conn = c;
+	rt->server = server;
+
+	begin_phase(rt, RT_PHASE_CONNECT);
+	c->fd = open_call(&servers[server], 0, 0, HELLO_PUBLISHED, pub->id,
+			  call_timeout_ms(timeout_ns));
+	end_phase(rt, RT_PHASE_CONNECT);
+	if (c->fd < 0)
+		goto err;
+
+	struct call call;
+	memset(&call, 0, sizeof call);
+	call.eip = htobe64((uint64_t) func - load_bias());
+	call.param_len = htobe64(param_len);
+	call.flags = htonl(CALL_INLINE_PARAM);
+	call.task = htonl(0);
+	struct iovec iov[2];
+	iov[0].iov_base = &call;
+	iov[0].iov_len = sizeof call;
+	iov[1].iov_base = (void *) param;
+	iov[1].iov_len = param_len;
+	begin_phase(rt, RT_PHASE_SEND_BINARY);
+	begin_phase(rt, RT_PHASE_SEND_HEAP);
+	if (read_welcome(c->fd) || writev_all(c->fd, iov, 2)) {
+		close(c->fd);
+		goto err;
+	}
+	end_phase(rt, RT_PHASE_SEND_HEAP);
+	stats[server].bytes_sent += sizeof(struct hello) + sizeof call
+		+ param_len;
+	stats[server].calls++;
+	rt->state = TASK_PENDING;
+	begin_phase(rt, RT_PHASE_WAIT);
+	rt->timeout = timeout_ns;
+	rt->deadline = timeout_ns ? now_ns() + timeout_ns : 0;
+	return rt;
+
+ oom:
+	warning("Out of memory\n");
+ err:
+	stats[server].calls++;
+	stats[server].errors++;
+	if (b)
+		free(b->tasks);
+	free(b);
+	free(c);
+	free(rt);
+	return NULL;
+}
+
+/* removes a published heap from the servers */
+int remotethread_unpublish(int version)
+{
+	struct publication *pub = find_publication(version);
+	if (pub == NULL)
+		return -1;
+	finish_push(pub);
+	int i;
+	for (i = 0; i < num_servers; ++i) {
+		if (pub->stored[i] != PUSH_STORED)
+			continue;
+		int fd = open_call(&servers[i], 0, 0, HELLO_UNPUBLISH,
+				   pub->id, 0);
+		if (fd >= 0) {
+			read_welcome(fd);
+			close(fd);
+		}
+	}
+	munmap(pub->stored, num_servers);
+	pub->stored = NULL;
+	free(pub->checkpoint);
+	pub->checkpoint = NULL;
+	return 0;
+}
+
+/*
+ * Sends a task to the next server on a connection of its own, with the
+ * image it was submitted with.
+ */
+static void resubmit(struct remotethread *rt)
+{
+	struct payload *p = rt->payload;
+	struct conn *c = calloc(1, sizeof *c);
+	struct batch *b = calloc(1, sizeof *b);
+	detach_task(rt);
+	if (c == NULL || b == NULL
+	    || (b->tasks = calloc(1, sizeof *b->tasks)) == NULL) {
+		warning("Out of memory\n");
+		free(c);
+		free(b);
+		rt->state = TASK_FAILED;
+		put_payload(rt);
+		return;
+	}
+	b->tasks[0] = rt;
+	b->num_tasks = 1;
+	b->refs = 1;
+	c->batch = b;
+	c->refs = 1;
+	rt->conn = c;
+	rt->task = 0;
+	rt->entry.task = htonl(0);
+	rt->server = next_server(rt->server + 1);
+
+	struct call call;
+	uint64_t binary_sent;
+	relay_call(&call, &rt->entry);
+	begin_phase(rt, RT_PHASE_CONNECT);
+	c->fd = open_call(&servers[rt->server], p->binary_len,
+			  p->img.alloc_len, 0, NULL, call_timeout_ms(rt->timeout));
+	end_phase(rt, RT_PHASE_CONNECT);
+	begin_phase(rt, RT_PHASE_SEND_BINARY);
+	if (c->fd < 0 || read_welcome(c->fd) != WELCOME_OK
+	    || send_call(c->fd, p->binary_len, &call, NULL, 0, &p->img, NULL,
+			 0, &binary_sent)) {
+		c->failed = 1;
+		retry_task(rt);
+		return;
+	}
+	rt->begin[RT_PHASE_SEND_HEAP] = binary_sent;
+	rt->phase[RT_PHASE_SEND_BINARY] =
+		binary_sent - rt->begin[RT_PHASE_SEND_BINARY];
+	end_phase(rt, RT_PHASE_SEND_HEAP);
+	stats[rt->server].bytes_sent += sizeof(struct hello) + p->binary_len
+		+ sizeof call + p->img.data_len;
+
+	rt->state = TASK_PENDING;
+	begin_phase(rt, RT_PHASE_WAIT);
+	rt->deadline = rt->timeout ? now_ns() + rt->timeout : 0;
+}
+
+/* fails the tasks that are still waiting for a reply on a connection */
+static void fail_conn(struct conn *c)
+{
+	int i;
+	c->failed = 1;
+	for (i = 0; i < c->batch->num_tasks; ++i) {
+		struct remotethread *rt = c->batch->tasks[i];
+		if (rt == NULL || rt->conn != c || rt->state != TASK_PENDING)
+			continue;
+		retry_task(rt);
+	}
+}
+
+/* whether the server has closed the connection or it has failed */
+static int conn_lost(int fd)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLRDHUP;
+	return poll(&pfd, 1, 0) > 0
+		&& (pfd.revents & (POLLRDHUP | POLLERR | POLLHUP));
+}
+
+/* finds the task that the reply header is for */
+static void handle_reply_header(struct conn *c)
+{
+	uint32_t task = ntohl(c->reply.task);
+	c->have_reply = 1;
+	c->target = NULL;
+	c->discard = be64toh(c->reply.reply_len);
+
+	if (task >= (uint32_t) c->batch->num_tasks) {
+		warning("reply to an unknown task\n");
+		return;
+	}
+	struct remotethread *rt = c->batch->tasks[task];
+	if (rt == NULL || rt->conn != c || rt->state != TASK_PENDING)
+		return;
+
+	end_phase(rt, RT_PHASE_WAIT);
+	begin_phase(rt, RT_PHASE_RECV_REPLY);
+	rt->reply = c->reply;
+	if (c->reply.status == STATUS_ERROR) {
+		warning("server returned an error\n");
+		retry_task(rt);
+		return;
+	}
+
+	rt->reply_len = c->discard;
+	rt->pos = 0;
+	rt->buf = malloc(rt->reply_len);
+	if (rt->buf == NULL) {
+		warning("Out of memory\n");
+		rt->state = TASK_FAILED;
+		return;
+	}
+	c->target = rt;
+	c->discard = 0;
+}
+
+/*
+ * Receives what has arrived on a connection. Returns 0 when nothing could
+ * be read and -1 when the connection has failed.
+ */
+static int pump_conn(struct conn *c)
+{
+	if (c->failed)
+		return -1;
+
+	if (!c->have_reply) {
+		if (bytes_available(c->fd) < sizeof(struct reply)) {
+			if (conn_lost(c->fd)) {
+				warning("connection to server lost\n");
+				goto fail;
+			}
+			return 0;
+		}
+		if (read_all(c->fd, &c->reply, sizeof(struct reply)))
+			goto fail;
+		if (ntohl(c->reply.task) == TASK_NONE) {
+			warning("server returned an error\n");
+			goto fail;
+		}
+		handle_reply_header(c);
+	}
+
+	/* replies to destroyed tasks are skipped */
+	struct remotethread *rt = c->target;
+	char discard[4096];
+	char *buf = discard;
+	size_t left = c->discard;
+	if (rt) {
+		buf = rt->buf + rt->pos;
+		left = rt->reply_len - rt->pos;
+	}
+
+	size_t len = left;
+	if (len > 0) {
+		len = min_size(len, bytes_available(c->fd));
+		if (len == 0) {
+			if (conn_lost(c->fd)) {
+				warning("connection to server lost\n");
+				goto fail;
+			}
+			return 0;
+		}
+	}
+	if (buf == discard)
+		len = min_size(len, sizeof discard);
+	if (read_all(c->fd, buf, len))
+		goto fail;
+
+	if (rt)
+		rt->pos += len;
+	else
+		c->discard -= len;
+	if (len == left) {
+		if (rt) {
+			end_phase(rt, RT_PHASE_RECV_REPLY);
+			rt->state = TASK_READY;
+		}
+		c->have_reply = 0;
+		c->target = NULL;
+	}
+	return 1;
+
+ fail:
+	fail_conn(c);
+	return -1;
+}
+
+static void *task_result(struct remotethread *rt, size_t *reply_len)
+{
+	put_payload(rt);
+	if (rt->state != TASK_READY) {
+		finish_call(rt, 0);
+		return NULL;
+	}
+	if (rt->keyed && !rt->done)
+		cache_insert(rt->key, rt->buf, rt->reply_len);
+	finish_call(rt, 1);
+	rt->delivered = 1;
+	*reply_len = rt->reply_len;
+	return rt->buf;
+}
+
+/* a task that has run out of time is sent again */
+static int timed_out(struct remotethread *rt)
+{
+	if (rt->deadline == 0 || now_ns() < rt->deadline)
+		return 0;
+	warning("task timed out\n");
+	retry_task(rt);
+	return 1;
+}
+
+/* reads what has arrived for a task, 1 once it has a result */
+static int task_ready(struct remotethread *rt)
+{
+	for (;;) {
+		if (rt->state == TASK_RETRY) {
+			if (now_ns() < rt->retry_at)
+				return 0;
+			resubmit(rt);
+		} else if (rt->state == TASK_PENDING) {
+			if (pump_conn(rt->conn) == 0 && !timed_out(rt))
+				return 0;
+		} else {
+			return 1;
+		}
+	}
+}
+
+void *poll_remotethread(struct remotethread *rt, size_t *reply_len)
+{
+	if (!task_ready(rt))
+		return RT_EAGAIN;
+	return task_result(rt, reply_len);
+}
+
+/*
+ * Sleeps until one of the tasks has a result for poll_remotethread(),
+ * and returns its index.
+ */
+int remotethread_wait_any(struct remotethread *const *threads, int num)
+{
+	if (num <= 0)
+		return -1;
+	struct pollfd *pfd = malloc(num * sizeof *pfd);
+	if (pfd == NULL) {
+		warning("Out of memory\n");
+		return -1;
+	}
+	for (;;) {
+		int i, n = 0, ms = -1;
+		for (i = 0; i < num; ++i) {
+			if (task_ready(threads[i])) {
+				free(pfd);
+				return i;
+			}
+		}
+
+		/* until something arrives, a retry is due or a task times out */
+		uint64_t now = now_ns();
+		for (i = 0; i < num; ++i) {
+			struct remotethread *rt = threads[i];
+			uint64_t until = rt->deadline;
+			if (rt->state == TASK_RETRY) {
+				until = rt->retry_at;
+			} else {
+				pfd[n].fd = rt->conn->fd;
+				pfd[n].events = POLLIN | POLLRDHUP;
+				n++;
+			}
+			if (until) {
+				int t = until > now ? (until - now) / 1000000 + 1
+					: 0;
+				if (ms < 0 || t < ms)
+					ms = t;
+			}
+		}
+		if (poll(pfd, n, ms) < 0 && errno != EINTR) {
+			warning("poll() failed (%s)\n", strerror(errno));
+			free(pfd);
+			return -1;
+		}
+	}
+}
+
+void *wait_remotethread(struct remotethread *rt, size_t *reply_len)
+{
+	for (;;) {
+		if (rt->state == TASK_RETRY) {
+			uint64_t now = now_ns();
+			if (now < rt->retry_at)
+				usleep((rt->retry_at - now) / 1000);
+			resubmit(rt);
+		} else if (rt->state == TASK_PENDING) {
+			if (pump_conn(rt->conn) || timed_out(rt))
+				continue;
+			/* until something arrives or the task times out */
+			struct pollfd pfd;
+			int ms = -1;
+			if (rt->deadline)
+				ms = (rt->deadline - now_ns()) / 1000000 + 1;
+			pfd.fd = rt->conn->fd;
+			pfd.events = POLLIN | POLLRDHUP;
+			poll(&pfd, 1, ms);
+		} else {
+			break;
+		}
+	}
+	return task_result(rt, reply_len);
+}
+
+/*
+ * Gives up on a task, which then fails. Its connection is closed unless
+ * other tasks of the same submission still wait on it, and the server
+ * kills the slave once the connection is closed.
+ */
+void remotethread_cancel(struct remotethread *rt)
+{
+	if (rt->state == TASK_READY || rt->state == TASK_FAILED)
+		return;
+	detach_task(rt);
+	put_payload(rt);
+	free(rt->buf);
+	rt->buf = NULL;
+	rt->state = TASK_FAILED;
+}
+
+/* the calls made from now on are killed after ms, 0 for no limit */
+void remotethread_set_timeout(unsigned int ms)
+{
+	timeout_ns = (uint64_t) ms * 1000000;
+}
+
+/* a reply from the client cache has no connection */
+void destroy_remotethread(struct remotethread *rt)
+{
+	detach_task(rt);
+	put_payload(rt);
+	if (!rt->delivered)
+		free(rt->buf);
+	free(rt);
+}
+
+/* items begin..end-1 */
+struct item_range {
+	size_t begin;
+	size_t end;
+};
+
+struct range_list {
+	struct item_range *ranges;
+	size_t num;
+	size_t size;
+};
+
+/* a worker of a parallel map, and the ranges it has not answered yet */
+struct worker {
+	int fd;
+	int server;
+	size_t begin[WORKER_DEPTH];
+	size_t end[WORKER_DEPTH];
+	uint64_t sent[WORKER_DEPTH];
+	int head;
+	int count;
+	uint64_t last_done;
+	double rate;		/* items per nanosecond, 0 until measured */
+	/* the ranges in its reduced result, lost if it fails */
+	struct range_list done;
+};
+
+struct parallel {
+	remotethread_map_t map;
+	remotethread_reduce_t reduce;
+	const void *arg;
+	size_t arg_len;
+	const struct remotethread_range *range;
+	remotethread_collect_t collect;
+	void *ctx;
+	struct worker *workers;
+	int num_workers;
+	size_t next;
+	/* ranges of failed workers, handed out again before new ones */
+	struct range_list lost;
+	void *result;
+	size_t result_len;
+};
+
+static int add_range(struct range_list *list, size_t begin, size_t end)
+{
+	if (list->num == list->size) {
+		size_t size = list->size ? 2 * list->size : 16;
+		struct item_range *ranges = realloc(list->ranges,
+						    size * sizeof *ranges);
+		if (ranges == NULL) {
+			warning("Out of memory\n");
+			return -1;
+		}
+		list->ranges = ranges;
+		list->size = size;
+	}
+	list->ranges[list->num].begin = begin;
+	list->ranges[list->num].end = end;
+	list->num++;
+	return 0;
+}
+
+static int move_ranges(struct range_list *to, struct range_list *from)
+{
+	size_t i;
+	for (i = 0; i < from->num; ++i) {
+		if (add_range(to, from->ranges[i].begin, from->ranges[i].end))
+			return -1;
+	}
+	free(from->ranges);
+	memset(from, 0, sizeof *from);
+	return 0;
+}
+
+/* the ranges of a failed worker go to the others */
+static int drop_worker(struct parallel *p, struct worker *w)
+{
+	int i;
+	stats[w->server].errors++;
+	close(w->fd);
+	w->fd = -1;
+	for (i = 0; i < w->count; ++i) {
+		int slot = (w->head + i) % WORKER_DEPTH;
+		if (add_range(&p->lost, w->begin[slot], w->end[slot]))
+			return -1;
+	}
+	w->count = 0;
+	return move_ranges(&p->lost, &w->done);
+}
+
+static int work_left(const struct parallel *p)
+{
+	return p->lost.num > 0 || p->next < p->range->num_items;
+}
+
+/*
+ * Guided scheduling: a share of what is left, but long enough to hide
+ * the round trip once the speed of the worker is known. The first
+ * ranges are short to measure it.
+ */
+static size_t range_size(const struct parallel *p, const struct worker *w)
+{
+	size_t left = p->range->num_items - p->next;
+	size_t size = left / (2 * p->num_workers);
+	if (w->rate == 0) {
+		size_t probe = p->range->num_items
+			/ (PROBE_RANGES * p->num_workers);
+		if (size > probe)
+			size = probe;
+	} else if (size < w->rate * MIN_RANGE_NS) {
+		size = w->rate * MIN_RANGE_NS;
+	}
+	if (size < 1)
+		size = 1;
+	if (size > left)
+		size = left;
+	return size;
+}
+
+static int send_range(struct parallel *p, struct worker *w)
+{
+	size_t begin, size;
+	int lost = p->lost.num > 0;
+	if (lost) {
+		struct item_range *r = &p->lost.ranges[p->lost.num - 1];
+		begin = r->begin;
+		size = r->end - r->begin;
+	} else {
+		begin = p->next;
+		size = range_size(p, w);
+	}
+	int slot = (w->head + w->count) % WORKER_DEPTH;
+	struct work work;
+	work.begin = htobe64(begin);
+	work.end = htobe64(begin + size);
+	work.merge_len = 0;
+
+	struct iovec iov[2];
+	iov[0].iov_base = &work;
+	iov[0].iov_len = sizeof work;
+	iov[1].iov_base = NULL;
+	iov[1].iov_len = 0;
+	if (p->range->items) {
+		iov[1].iov_base = (char *) p->range->items
+			+ begin * p->range->item_size;
+		iov[1].iov_len = size * p->range->item_size;
+	}
+	if (writev_all(w->fd, iov, 2))
+		return -1;
+	stats[w->server].bytes_sent += sizeof work + iov[1].iov_len;
+
+	w->begin[slot] = begin;
+	w->end[slot] = begin + size;
+	w->sent[slot] = now_ns();
+	w->count++;
+	if (lost)
+		p->lost.num--;
+	else
+		p->next += size;
+	return 0;
+}
+
+/* an empty range with a result to merge, or without to end the work */
+static int send_merge(struct worker *w, const void *buf, size_t len)
+{
+	struct work work;
+	work.begin = 0;
+	work.end = 0;
+	work.merge_len = htobe64(len);
+
+	struct iovec iov[2];
+	iov[0].iov_base = &work;
+	iov[0].iov_len = sizeof work;
+	iov[1].iov_base = (void *) buf;
+	iov[1].iov_len = len;
+	if (writev_all(w->fd, iov, 2))
+		return -1;
+	stats[w->server].bytes_sent += sizeof work + len;
+	return 0;
+}
+
+/* reads a reply of a worker, NULL with zero length if it is empty */
+static int read_result(struct worker *w, void **buf, size_t *len)
+{
+	struct reply reply;
+	*buf = NULL;
+	if (read_all(w->fd, &reply, sizeof reply))
+		return -1;
+	if (reply.status != STATUS_OK) {
+		warning("server returned an error\n");
+		return -1;
+	}
+	*len = be64toh(reply.reply_len);
+	if (*len == 0)
+		return 0;
+	*buf = malloc(*len);
+	if (*buf == NULL) {
+		warning("Out of memory\n");
+		return -1;
+	}
+	if (read_all(w->fd, *buf, *len)) {
+		free(*buf);
+		return -1;
+	}
+	stats[w->server].reply_bytes += *len;
+	return 0;
+}
+
+static int handle_range(struct parallel *p, struct worker *w)
+{
+	void *buf;
+	size_t len;
+	if (read_result(w, &buf, &len))
+		return -1;
+
+	int slot = w->head;
+	uint64_t now = now_ns();
+	uint64_t start = w->sent[slot] > w->last_done ? w->sent[slot]
+		: w->last_done;
+	double rate = (double) (w->end[slot] - w->begin[slot])
+		/ (now - start + 1);
+	w->rate = w->rate ? (w->rate + rate) / 2 : rate;
+	w->last_done = now;
+	w->head = (w->head + 1) % WORKER_DEPTH;
+	w->count--;
+
+	if (p->collect)
+		p->collect(p->ctx, w->begin[slot], w->end[slot], buf, len);
+	free(buf);
+	if (p->reduce)
+		return add_range(&w->done, w->begin[slot], w->end[slot]);
+	return 0;
+}
+
+/* hands out ranges until all are done, -1 if the workers are gone */
+static int distribute(struct parallel *p, struct pollfd *pfd,
+		      struct worker **polled)
+{
+	/* large items are not queued, the worker would not be reading */
+	int i, depth = p->range->items ? 1 : WORKER_DEPTH;
+	for (;;) {
+		int n = 0;
+		for (i = 0; i < p->num_workers; ++i) {
+			struct worker *w = &p->workers[i];
+			while (w->fd >= 0 && w->count < depth && work_left(p)) {
+				if (send_range(p, w) && drop_worker(p, w))
+					return -1;
+			}
+			if (w->fd < 0 || w->count == 0)
+				continue;
+			pfd[n].fd = w->fd;
+			pfd[n].events = POLLIN;
+			polled[n++] = w;
+		}
+		if (n == 0)
+			break;
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			warning("poll() failed (%s)\n", strerror(errno));
+			return -1;
+		}
+		for (i = 0; i < n; ++i) {
+			if (pfd[i].revents && handle_range(p, polled[i])
+			    && drop_worker(p, polled[i]))
+				return -1;
 		}
 	}
+	if (work_left(p)) {
+		warning("all workers failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Tree reduction: in each round half of the workers end and their
+ * results are merged into the other half, so the reduce function runs
+ * on the workers in parallel and the rounds grow with log2 of their
+ * number. Returns 1 if a worker failed and its ranges have to be
+ * handed out again.
+ */
+static int reduce_workers(struct parallel *p, struct worker **live,
+			  struct worker **merged)
+{
+	int i, n = 0;
+	for (i = 0; i < p->num_workers; ++i) {
+		if (p->workers[i].fd >= 0)
+			live[n++] = &p->workers[i];
+	}
+	if (n == 0) {
+		warning("all workers failed\n");
+		return -1;
+	}
+	while (n > 1) {
+		/* live[keep + i] is merged into live[i] */
+		int keep = (n + 1) / 2, num_merged = 0;
+		for (i = keep; i < n; ++i) {
+			if (send_merge(live[i], NULL, 0)
+			    && drop_worker(p, live[i]))
+				return -1;
+		}
+		for (i = keep; i < n; ++i) {
+			struct worker *src = live[i], *dst = live[i - keep];
+			void *buf;
+			size_t len;
+			if (src->fd < 0)
+				continue;
+			if (read_result(src, &buf, &len)) {
+				if (drop_worker(p, src))
+					return -1;
+				continue;
+			}
+			close(src->fd);
+			src->fd = -1;
+			int ret = move_ranges(&dst->done, &src->done);
+			if (ret == 0 && len > 0 && send_merge(dst, buf, len))
+				ret = drop_worker(p, dst);
+			else if (len > 0)
+				merged[num_merged++] = dst;
+			free(buf);
+			if (ret)
+				return -1;
+		}
+		for (i = 0; i < num_merged; ++i) {
+			void *buf;
+			size_t len;
+			if (read_result(merged[i], &buf, &len)) {
+				if (drop_worker(p, merged[i]))
+					return -1;
+				continue;
+			}
+			free(buf);
+		}
+		if (p->lost.num > 0)
+			return 1;
+		for (i = 0, n = 0; i < keep; ++i) {
+			if (live[i]->fd >= 0)
+				live[n++] = live[i];
+		}
+		if (n == 0) {
+			warning("all workers failed\n");
+			return -1;
+		}
+	}
+
+	/* an empty range ends the work and brings the reduced result */
+	if (send_merge(live[0], NULL, 0)
+	    || read_result(live[0], &p->result, &p->result_len))
+		return drop_worker(p, live[0]) ? -1 : 1;
+	close(live[0]->fd);
+	live[0]->fd = -1;
+	return 0;
+}
+
+/* starts a worker on each server and hands out ranges until all are done */
+static int run_parallel(struct parallel *p)
+{
+	if (num_servers == 0) {
+		warning("no servers defined! use --remotethread [ip]\n");
+		return -1;
+	}
+	if (p->range->num_items == 0) {
+		warning("empty range\n");
+		return -1;
+	}
+
+	struct stat stbuf;
+	if (binary_fd < 0 || fstat(binary_fd, &stbuf)) {
+		warning("Unable to open %s\n", my_binary);
+		return -1;
+	}
+	size_t binary_len = stbuf.st_size;
+	int i, ret = -1, live = 0;
+
+	p->num_workers = num_servers * workers_per_server;
+	p->workers = calloc(p->num_workers, sizeof *p->workers);
+	struct pollfd *pfd = calloc(p->num_workers, sizeof *pfd);
+	struct worker **polled = calloc(p->num_workers, sizeof *polled);
+	struct worker **merged = calloc(p->num_workers, sizeof *merged);
+	if (p->workers == NULL || pfd == NULL || polled == NULL
+	    || merged == NULL) {
+		warning("Out of memory\n");
+		goto out;
+	}
+	for (i = 0; i < p->num_workers; ++i) {
+		struct worker *w = &p->workers[i];
+		w->server = i % num_servers;
+		w->fd = open_call(&servers[w->server], binary_len,
+				  p->range->items ? 0 : heap_size(), 0, NULL, 0);
+	}
+
+	/* the items are sent with the ranges, the heap is not needed then */
+	struct image img;
+	struct remotethread timing;
+	memset(&img, 0, sizeof img);
+	if (p->range->items == NULL && prepare_image(&img, &timing))
+		goto out;
+
+	struct worker_param wp;
+	wp.reduce = htobe64(p->reduce ? (uint64_t) p->reduce - load_bias()
+			    : 0);
+	wp.item_size = htobe64(p->range->items ? p->range->item_size : 0);
+	struct iovec iov[MAX_PARAM_IOV];
+	iov[0].iov_base = &wp;
+	iov[0].iov_len = sizeof wp;
+	iov[1].iov_base = (void *) p->arg;
+	iov[1].iov_len = p->arg_len;
+
+	for (i = 0; i < p->num_workers; ++i) {
+		struct worker *w = &p->workers[i];
+		struct remotethread_stats *st = &stats[w->server];
+		if (w->fd < 0)
+			continue;
+		struct call call;
+		call.eip = htobe64((uint64_t) p->map - load_bias());
+		call.task = htonl(i);
+		call.param = 0;
+		call.param_len = htobe64(sizeof wp + p->arg_len);
+		call.flags = htonl(CALL_WORKER);
+		st->calls++;
+		if (read_welcome(w->fd)
+		    || send_call(w->fd, binary_len, &call, NULL, 0, &img,
+				 iov, MAX_PARAM_IOV, NULL)) {
+			st->errors++;
+			close(w->fd);
+			w->fd = -1;
+			continue;
+		}
+		st->bytes_sent += sizeof(struct hello) + binary_len
+			+ sizeof call + img.data_len + sizeof wp + p->arg_len;
+		st->heap_bytes += img.len;
+		st->heap_compr_bytes += img.data_len;
+		live++;
+	}
+	if (img.compr)
+		free_buffer(img.compr);
+	if (live == 0)
+		goto out;
+
+	/* the ranges of workers failing in the reduction are run again */
+	int again;
+	do {
+		if (distribute(p, pfd, polled))
+			goto out;
+		again = p->reduce ? reduce_workers(p, polled, merged) : 0;
+		if (again < 0)
+			goto out;
+	} while (again);
+	ret = 0;
+
+	/* the results have been collected, the workers only have to end */
+	for (i = 0; !p->reduce && i < p->num_workers; ++i) {
+		struct worker *w = &p->workers[i];
+		void *buf;
+		size_t len;
+		if (w->fd >= 0 && send_merge(w, NULL, 0) == 0
+		    && read_result(w, &buf, &len) == 0)
+			free(buf);
+	}
+
+ out:
+	for (i = 0; p->workers && i < p->num_workers; ++i) {
+		if (p->workers[i].fd >= 0)
+			close(p->workers[i].fd);
+		free(p->workers[i].done.ranges);
+	}
+	free(p->workers);
+	free(p->lost.ranges);
+	free(pfd);
+	free(polled);
+	free(merged);
+	return ret;
+}
+
+int remotethread_parallel_map(remotethread_map_t map, const void *arg,
+			      size_t arg_len,
+			      const struct remotethread_range *range,
+			      remotethread_collect_t collect, void *ctx)
+{
+	struct parallel p;
+	memset(&p, 0, sizeof p);
+	p.map = map;
+	p.arg = arg;
+	p.arg_len = arg_len;
+	p.range = range;
+	p.collect = collect;
+	p.ctx = ctx;
+	return run_parallel(&p);
+}
+
+void *remotethread_parallel_reduce(remotethread_map_t map,
+				   remotethread_reduce_t reduce,
+				   const void *arg, size_t arg_len,
+				   const struct remotethread_range *range,
+				   size_t *reply_len)
+{
+	struct parallel p;
+	memset(&p, 0, sizeof p);
+	p.map = map;
+	p.reduce = reduce;
+	p.arg = arg;
+	p.arg_len = arg_len;
+	p.range = range;
+	if (run_parallel(&p)) {
+		free(p.result);
+		return NULL;
+	}
+	*reply_len = p.result_len;
+	return p.result;
+}
+
+int remotethread_num_servers(void)
+{
+	return num_servers;
+}
+
+/* server -1 gives the sum over all servers */
+int remotethread_get_stats(int server, struct remotethread_stats *st)
+{
+	if (server < -1 || server >= num_servers)
+		return -1;
+	if (server >= 0) {
+		*st = stats[server];
+		return 0;
+	}
+
+	memset(st, 0, sizeof *st);
+	int i, j;
+	for (i = 0; i < num_servers; ++i) {
+		st->calls += stats[i].calls;
+		st->errors += stats[i].errors;
+		st->bytes_sent += stats[i].bytes_sent;
+		st->heap_bytes += stats[i].heap_bytes;
+		st->heap_compr_bytes += stats[i].heap_compr_bytes;
+		st->reply_bytes += stats[i].reply_bytes;
+		st->cache_hits += stats[i].cache_hits;
+		st->retries += stats[i].retries;
+		for (j = 0; j < RT_NUM_PHASES; ++j) {
+			st->phase_time[j] += stats[i].phase_time[j];
+			if (stats[i].phase_max[j] > st->phase_max[j])
+				st->phase_max[j] = stats[i].phase_max[j];
+		}
+	}
+	return 0;
+}
+
+/* asks a server for its memory budget and what is reserved of it */
+int remotethread_server_status(int server,
+			       struct remotethread_server_status *st)
+{
+	if (server < 0 || server >= num_servers)
+		return -1;
+	int fd = open_call(&servers[server], 0, 0, HELLO_STATUS, NULL, 0);
+	if (fd < 0)
+		return -1;
+	struct server_status status;
+	int ret = -1;
+	if (read_welcome(fd) == WELCOME_OK
+	    && read_all(fd, &status, sizeof status) == 0) {
+		st->memory = be64toh(status.memory);
+		st->reserved = be64toh(status.reserved);
+		st->calls = ntohl(status.calls);
+		ret = 0;
+	}
+	close(fd);
+	return ret;
+}
+
+const char *remotethread_phase_name(int phase)
+{
+	static const char *const names[RT_NUM_PHASES] = {
+		"connect", "read binary", "send binary", "zero", "deflate",
+		"send heap", "wait", "receive reply", "receive binary", "exec",
+		"receive heap", "inflate", "func",
+	};
+	if (phase < 0 || phase >= RT_NUM_PHASES)
+		return NULL;
+	return names[phase];
+}
+
+/* writes the recorded calls in Chrome trace event format */
+int remotethread_write_trace(const char *fname)
+{
+	FILE *f = fopen(fname, "w");
+	if (f == NULL) {
+		warning("Unable to write to %s\n", fname);
+		return -1;
+	}
+	fprintf(f, "{\"traceEvents\": [\n");
+	const char *sep = "";
+	size_t i;
+	for (i = 0; i < trace_len; ++i) {
+		const struct trace_call *tc = &trace[i];
+		int j;
+		for (j = 0; j < RT_NUM_PHASES; ++j) {
+			fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"%s\", "
+				"\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+				"\"pid\": %d, \"tid\": %zu}", sep,
+				remotethread_phase_name(j),
+				j >= RT_PHASE_RECV_BINARY ? "remote" : "client",
+				tc->begin[j] / 1000.0, tc->phase[j] / 1000.0,
+				tc->server, i);
+			sep = ",\n";
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	return 0;
+}
+
+static void write_trace_at_exit(void)
+{
+	remotethread_write_trace(trace_fname);
+}
+
+/* a task that the slave starts on another server, with its subtree */
+struct child {
+	int fd;
+	const struct relay *relays;	/* the task itself first */
+	int num_relays;
+	char *replied;
+	int left;
+	void *param;	/* own parameters of a chained task */
+};
+
+static int send_error(int fd, uint32_t task)
+{
+	struct reply reply;
+	memset(&reply, 0, sizeof reply);
+	reply.status = STATUS_ERROR;
+	reply.task = htonl(task);
+	return write_all(fd, &reply, sizeof reply);
+}
+
+static void free_children(struct child *children, int num_children)
+{
+	int i;
+	for (i = 0; i < num_children; ++i) {
+		struct child *c = &children[i];
+		if (c->fd >= 0)
+			close(c->fd);
+		if (c->replied)
+			free_buffer(c->replied);
+		if (c->param)
+			free_buffer(c->param);
+	}
+	free_buffer(children);
+}
+
+/*
+ * Splits the relays into the subtrees of the tasks that we start. Nothing
+ * may be allocated from the heap before it is in place.
+ */
+static struct child *split_children(const struct relay *relays,
+				    int num_relays, int *num_children)
+{
+	int n = 0, i;
+	for (i = 0; i < num_relays; i += 1 + ntohl(relays[i].num_below)) {
+		if (ntohl(relays[i].num_below) >= (uint32_t) (num_relays - i)) {
+			warning("invalid relays\n");
+			return NULL;
+		}
+		n++;
+	}
+
+	struct child *children = alloc_buffer(n * sizeof *children);
+	if (children == NULL) {
+		warning("Out of memory\n");
+		return NULL;
+	}
+	*num_children = 0;
+	i = 0;
+	while (i < num_relays) {
+		struct child *c = &children[(*num_children)++];
+		c->fd = -1;
+		c->relays = relays + i;
+		c->num_relays = 1 + ntohl(relays[i].num_below);
+		c->left = c->num_relays;
+		c->replied = alloc_buffer(c->num_relays);
+		if (c->replied == NULL) {
+			warning("Out of memory\n");
+			free_children(children, *num_children);
+			return NULL;
+		}
+		i += c->num_relays;
+	}
+	return children;
+}
+
+static int is_chained(const struct child *c)
+{
+	return (ntohl(c->relays[0].flags) & RELAY_CHAINED) != 0;
+}
+
+/*
+ * Starts either the tasks that we relay the heap to, or the chained tasks
+ * with our reply appended to their parameters.
+ */
+static void start_children(struct child *children, int num_children,
+			   int chained, const struct image *img,
+			   const void *reply, size_t reply_len)
+{
+	struct stat stbuf;
+	int i;
+	if (binary_fd < 0 || fstat(binary_fd, &stbuf))
+		return;
+	size_t binary_len = stbuf.st_size;
+
+	for (i = 0; i < num_children; ++i) {
+		struct child *c = &children[i];
+		if (is_chained(c) != chained || (chained && c->param == NULL))
+			continue;
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = c->relays[0].addr;
+		sin.sin_port = c->relays[0].port;
+		c->fd = open_call(&sin, binary_len, img->alloc_len, 0, NULL,
+				  call_timeout_ms(0));
+	}
 
-	size_t avail = bytes_available(rt->fd);
-	if (avail == 0)
-		return RT_EAGAIN;
-	if (avail > rt->reply_len - rt->pos) {
-		warning("extra bytes in reply?\n");
-		avail = rt->reply_len - rt->pos;
+	for (i = 0; i < num_children; ++i) {
+		struct child *c = &children[i];
+		if (c->fd < 0 || is_chained(c) != chained)
+			continue;
+		struct call call;
+		struct iovec iov[MAX_PARAM_IOV];
+		relay_call(&call, c->relays);
+		if (chained) {
+			size_t param_len = be64toh(c->relays[0].param_len);
+			iov[0].iov_base = c->param;
+			iov[0].iov_len = param_len;
+			iov[1].iov_base = (void *) reply;
+			iov[1].iov_len = reply_len;
+			call.param_len = htobe64(param_len + reply_len);
+		}
+		if (read_welcome(c->fd)
+		    || send_call(c->fd, binary_len, &call, c->relays + 1,
+				 c->num_relays - 1, img, iov,
+				 chained ? MAX_PARAM_IOV : 0, NULL)) {
+			close(c->fd);
+			c->fd = -1;
+		}
 	}
+}
 
-	size_t got = read_available(rt->fd, rt->buf + rt->pos, avail);
-	if (got == 0) {
-		free(rt->buf);
-		return NULL;
+/* passes one reply of a subtree up */
+static int forward_reply(int fd, struct child *c)
+{
+	struct reply reply;
+	if (read_all(c->fd, &reply, sizeof reply))
+		return -1;
+	uint32_t task = ntohl(reply.task);
+	if (task == TASK_NONE)
+		return -1;
+
+	int i;
+	for (i = 0; i < c->num_relays; ++i) {
+		if (ntohl(c->relays[i].task) == task && !c->replied[i])
+			break;
+	}
+	if (i == c->num_relays) {
+		warning("reply to an unknown task\n");
+		return -1;
 	}
-	rt->pos += got;
-	if (rt->pos < rt->reply_len)
-		return RT_EAGAIN;
 
-	*reply_len = rt->reply_len;
-	return rt->buf;
+	/* read it all first, so that a failing child does not cut it */
+	size_t len = be64toh(reply.reply_len);
+	char *buf = len ? alloc_buffer(len) : NULL;
+	if (len && buf == NULL) {
+		warning("Out of memory\n");
+		return -1;
+	}
+	if (len && read_all(c->fd, buf, len)) {
+		free_buffer(buf);
+		return -1;
+	}
+	struct iovec iov[2];
+	iov[0].iov_base = &reply;
+	iov[0].iov_len = sizeof reply;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	int ret = writev_all(fd, iov, 2);
+	if (buf)
+		free_buffer(buf);
+	if (ret)
+		return -2;
+	c->replied[i] = 1;
+	c->left--;
+	return 0;
 }
 
-void *wait_remotethread(struct remotethread *rt, size_t *reply_len)
+/* passes the replies of the subtrees up until all have been answered */
+static int relay_replies(int fd, struct child *children, int num_children)
 {
-	if (rt->reply_len == 0) {
-		if (read_all(rt->fd, &rt->reply, sizeof(struct reply)))
-			return NULL;
+	struct pollfd *pfd = alloc_buffer(num_children * sizeof *pfd);
+	struct child **polled = alloc_buffer(num_children * sizeof *polled);
+	int i, ret = 0;
+	if (pfd == NULL || polled == NULL) {
+		warning("Out of memory\n");
+		ret = -1;
+		goto out;
+	}
 
-		if (rt->reply.status == STATUS_ERROR) {
-			warning("server returned an error\n");
-			return NULL;
+	for (;;) {
+		int n = 0;
+		for (i = 0; i < num_children; ++i) {
+			if (children[i].fd < 0 || children[i].left == 0)
+				continue;
+			pfd[n].fd = children[i].fd;
+			pfd[n].events = POLLIN;
+			polled[n++] = &children[i];
+		}
+		if (n == 0)
+			break;
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			warning("poll() failed (%s)\n", strerror(errno));
+			ret = -1;
+			goto out;
 		}
 
-		rt->reply_len = ntohl(rt->reply.reply_len);
-		rt->pos = 0;
-		rt->buf = malloc(rt->reply_len);
-		if (rt->buf == NULL) {
-			warning("Out of memory\n");
-			return NULL;
+		for (i = 0; i < n; ++i) {
+			if (pfd[i].revents == 0)
+				continue;
+			int err = forward_reply(fd, polled[i]);
+			if (err == -2) {
+				ret = -1;
+				goto out;
+			}
+			if (err) {
+				close(polled[i]->fd);
+				polled[i]->fd = -1;
+			}
 		}
 	}
 
-	if (read_all(rt->fd, rt->buf + rt->pos, rt->reply_len - rt->pos)) {
-		free(rt->buf);
-		return NULL;
+	/* the tasks of failed subtrees */
+	for (i = 0; i < num_children && ret == 0; ++i) {
+		struct child *c = &children[i];
+		int j;
+		for (j = 0; j < c->num_relays && ret == 0; ++j) {
+			if (!c->replied[j])
+				ret = send_error(fd, ntohl(c->relays[j].task));
+		}
 	}
-	rt->pos = rt->reply_len;
-	*reply_len = rt->reply_len;
-	return rt->buf;
-} 
+ out:
+	if (pfd)
+		free_buffer(pfd);
+	if (polled)
+		free_buffer(polled);
+	return ret;
+}
 
-void destroy_remotethread(struct remotethread *rt)
+/* runs ranges and merges the results of other workers until the end */
+static int run_worker(int fd, uint32_t task, remotethread_map_t map,
+		      const void *param, size_t param_len)
 {
-	close(rt->fd);
-	free(rt);
+	struct worker_param wp;
+	if (param_len < sizeof wp) {
+		warning("invalid worker parameters\n");
+		return send_error(fd, task);
+	}
+	memcpy(&wp, param, sizeof wp);
+	const void *arg = (const char *) param + sizeof wp;
+	size_t arg_len = param_len - sizeof wp;
+	size_t item_size = be64toh(wp.item_size);
+	remotethread_reduce_t reduce = NULL;
+	if (wp.reduce)
+		reduce = (remotethread_reduce_t) (be64toh(wp.reduce)
+						  + load_bias());
+
+	struct reply reply;
+	memset(&reply, 0, sizeof reply);
+	reply.status = STATUS_OK;
+	reply.task = htonl(task);
+	void *acc = NULL;
+	size_t acc_len = 0;
+	for (;;) {
+		struct work work;
+		if (read_all(fd, &work, sizeof work))
+			return -1;
+		size_t begin = be64toh(work.begin);
+		size_t end = be64toh(work.end);
+		size_t len = be64toh(work.merge_len);
+		if (begin >= end && len == 0)
+			break;
+
+		void *result;
+		if (begin >= end) {
+			/* the result of another worker */
+			if (reduce == NULL) {
+				warning("merge without a reduce function\n");
+				return send_error(fd, task);
+			}
+			result = malloc(len);
+			if (result == NULL) {
+				warning("Out of memory\n");
+				return send_error(fd, task);
+			}
+			if (read_all(fd, result, len)) {
+				free(result);
+				return -1;
+			}
+		} else {
+			void *items = NULL;
+			if (item_size) {
+				items = malloc((end - begin) * item_size);
+				if (items == NULL) {
+					warning("Out of memory\n");
+					return send_error(fd, task);
+				}
+				if (read_all(fd, items,
+					     (end - begin) * item_size))
+					return -1;
+			}
+			result = map(arg, arg_len, items, begin, end, &len);
+			free(items);
+			if (result == NULL)
+				return send_error(fd, task);
+		}
+
+		/* the results are combined here, the client gets an ack */
+		if (reduce) {
+			if (acc == NULL) {
+				acc = result;
+				acc_len = len;
+			} else {
+				size_t new_len;
+				void *new_acc = reduce(arg, arg_len, acc, acc_len,
+						       result, len, &new_len);
+				if (new_acc != acc)
+					free(acc);
+				if (new_acc != result)
+					free(result);
+				acc = new_acc;
+				acc_len = new_len;
+				if (acc == NULL)
+					return send_error(fd, task);
+			}
+			len = 0;
+		}
+
+		reply.reply_len = htobe64(len);
+		struct iovec iov[2];
+		iov[0].iov_base = &reply;
+		iov[0].iov_len = sizeof reply;
+		iov[1].iov_base = result;
+		iov[1].iov_len = len;
+		int ret = writev_all(fd, iov, 2);
+		if (!reduce)
+			free(result);
+		if (ret)
+			return -1;
+	}
+
+	reply.reply_len = htobe64(acc_len);
+	struct iovec iov[2];
+	iov[0].iov_base = &reply;
+	iov[0].iov_len = sizeof reply;
+	iov[1].iov_base = acc;
+	iov[1].iov_len = acc_len;
+	int ret = writev_all(fd, iov, 2);
+	free(acc);
+	return ret;
 }
 
-static int slave(int fd)
+/* the file appears complete or not at all */
+static void store_reply(const void *buf, size_t len)
 {
-	struct call call;
-	if (read_all(fd, &call, sizeof call))
-		return -1;
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof tmp, "%s.%d", cache_file, getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return;
+	if (write_all(fd, buf, len) || rename(tmp, cache_file))
+		unlink(tmp);
+	close(fd);
+}
 
-	size_t alloc_len = ntohl(call.alloc_len);
-	size_t alloc_compr_len = ntohl(call.alloc_compr_len);
-	size_t param_len = ntohl(call.param_len);
+/*
+ * Maps the heap and reads its image from fd, straight into place if it
+ * is not compressed. There is no heap if only the items of a range are
+ * sent.
+ */
+static int read_image(int fd, struct image *img, size_t alloc_len,
+		      size_t alloc_compr_len, uint32_t flags)
+{
+	size_t map_len = round_up(alloc_len, grow_granularity());
+	if (map_len && map_alloc((void *) ALLOC_BEGIN, map_len))
+		return -1;
+	current_end = (char *) ALLOC_BEGIN + alloc_len;
 
-	void *compr_alloc = zlib_alloc(NULL, alloc_compr_len, 1);
-	if (compr_alloc == NULL) {
+	img->alloc_len = alloc_len;
+	img->len = alloc_len;
+	img->data_len = alloc_compr_len;
+	if (flags & CALL_RAW_HEAP) {
+		if (alloc_compr_len > alloc_len) {
+			warning("heap image is too large\n");
+			return -1;
+		}
+		if (read_all(fd, (void *) ALLOC_BEGIN, alloc_compr_len))
+			return -1;
+		img->data = (const void *) ALLOC_BEGIN;
+		return 0;
+	}
+	img->compr = alloc_buffer(alloc_compr_len);
+	if (img->compr == NULL) {
 		warning("Out of memory\n");
 		return -1;
 	}
+	if (read_all(fd, img->compr, alloc_compr_len))
+		return -1;
+	img->data = img->compr;
+	return 0;
+}
+
+/* updates last_chunk once the image is in place, unless it is known */
+static void place_image(size_t alloc_len, struct chunk *last)
+{
+	struct chunk *chunk = first_chunk;
+	last_chunk = last;
+	while (last == NULL && chunk != (struct chunk *) current_end) {
+		last_chunk = chunk;
+		chunk = (struct chunk *) ((char *) chunk + chunk->size);
+	}
+	size_t map_len = round_up(alloc_len, grow_granularity());
+	if (map_len > alloc_len)
+		append_free_chunk(map_len - alloc_len);
+}
 
-	if (read_all(fd, compr_alloc, alloc_compr_len)) {
-		zlib_free(NULL, compr_alloc);
+/*
+ * Maps the raw image of a heap file in place, copy-on-write, so that its
+ * pages are only read as they are touched.
+ */
+static int map_heap_file(int fd, const struct heap_file *hdr)
+{
+	size_t alloc_len = be64toh(hdr->call.alloc_len);
+	size_t file_len = round_up(alloc_len, PAGE_SIZE);
+	size_t map_len = round_up(alloc_len, grow_granularity());
+	void *start = (void *) ALLOC_BEGIN;
+	void *ptr = mmap(start, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			 fd, HEAP_FILE_HEADER);
+	if (ptr == MAP_FAILED) {
+		warning("mmap() failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (ptr != start) {
+		warning("unable to map heap at %p\n", start);
+		munmap(ptr, file_len);
+		return -1;
+	}
+	if (map_len > file_len && map_alloc((char *) start + file_len,
+					    map_len - file_len)) {
+		munmap(start, file_len);
 		return -1;
 	}
+	current_end = (char *) start + alloc_len;
+	place_image(alloc_len, (struct chunk *) be64toh(hdr->last_chunk));
+	if (hdr->alloc_chunk)
+		alloc_chunk = (struct chunk *) be64toh(hdr->alloc_chunk);
+	return 0;
+}
+
+/* reads the header of a heap file and leaves fd at the image */
+static int read_heap_header(int fd, struct heap_file *hdr, struct stat *st)
+{
+	if (read_all(fd, hdr, sizeof *hdr) || fstat(fd, st)
+	    || ntohl(hdr->magic) != HEAP_MAGIC
+	    || lseek(fd, HEAP_FILE_HEADER, SEEK_SET) != HEAP_FILE_HEADER)
+		return -1;
+	return 0;
+}
 
-	if (grow_alloc(alloc_len) == NULL) {
-		zlib_free(NULL, compr_alloc);
+/*
+ * Loads a published heap. A raw image is mapped from the file, others are
+ * read and inflated.
+ */
+static int load_heap_file(void)
+{
+	struct heap_file hdr;
+	struct image img;
+	struct stat st;
+	memset(&img, 0, sizeof img);
+	int fd = open(heap_file, O_RDONLY);
+	if (fd < 0 || read_heap_header(fd, &hdr, &st)) {
+		warning("Unable to read %s\n", heap_file);
+		if (fd >= 0)
+			close(fd);
 		return -1;
 	}
+	size_t alloc_len = be64toh(hdr.call.alloc_len);
+	size_t alloc_compr_len = be64toh(hdr.call.alloc_compr_len);
+	uint32_t flags = ntohl(hdr.call.flags);
+	if ((flags & CALL_RAW_HEAP)
+	    && (uint64_t) st.st_size >= HEAP_FILE_HEADER + alloc_len) {
+		int ret = map_heap_file(fd, &hdr);
+		close(fd);
+		if (ret)
+			return -1;
+		heap_loaded = 1;
+		return 0;
+	}
 
-	/* decompress allocation area */
-	z_stream strm;
-	strm.zalloc = zlib_alloc;
-	strm.zfree = zlib_free;
-	if (inflateInit(&strm) != Z_OK) {
-		warning("Unable to initialize inflate\n");
-		zlib_free(NULL, compr_alloc);
+	int ret = read_image(fd, &img, alloc_len, alloc_compr_len, flags);
+	close(fd);
+	if (ret == 0 && img.compr)
+		ret = inflate_heap(img.compr, alloc_compr_len, alloc_len);
+	if (img.compr)
+		free_buffer(img.compr);
+	if (ret)
+		return -1;
+	place_image(alloc_len, NULL);
+	heap_loaded = 1;
+	return 0;
+}
+
+/*
+ * Writes the heap to a heap file that --remotethread-restore maps back in
+ * place. The trailing free chunk is left as a hole in the file, and the
+ * file appears complete or not at all.
+ */
+int remotethread_checkpoint(const char *fname)
+{
+	struct remotethread timing;
+	struct image img;
+	memset(&timing, 0, sizeof timing);
+	memset(&img, 0, sizeof img);
+	zero_image(&img, &timing);
+	if (get_binary_hash()) {
+		warning("Unable to read %s\n", my_binary);
 		return -1;
 	}
-	strm.next_in = compr_alloc;
-	strm.avail_in = alloc_compr_len;
-	strm.next_out = (void *) ALLOC_BEGIN;
-	strm.avail_out = alloc_len;
-	int status = inflate(&strm, Z_NO_FLUSH);
-	inflateEnd(&strm);
-	zlib_free(NULL, compr_alloc);
 
-	if (status != Z_STREAM_END || strm.avail_in != 0
-	    || strm.avail_out != 0) {
-		warning("Unable to inflate alloc (%d)\n", status);
+	char header[HEAP_FILE_HEADER];
+	struct heap_file *hdr = (struct heap_file *) header;
+	memset(header, 0, sizeof header);
+	hdr->magic = htonl(HEAP_MAGIC);
+	hdr->call.alloc_len = htobe64(img.alloc_len);
+	hdr->call.alloc_compr_len = htobe64(img.len);
+	hdr->call.flags = htonl(CALL_RAW_HEAP);
+	hdr->binary_hash[0] = htobe64(binary_hash[0]);
+	hdr->binary_hash[1] = htobe64(binary_hash[1]);
+	hdr->last_chunk = htobe64((uint64_t) last_chunk);
+	hdr->alloc_chunk = htobe64((uint64_t) alloc_chunk);
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof tmp, "%s.%d", fname, getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		warning("Unable to write to %s\n", tmp);
+		return -1;
+	}
+	if (write_all(fd, header, sizeof header)
+	    || write_all(fd, (const void *) ALLOC_BEGIN, img.len)
+	    || ftruncate(fd, HEAP_FILE_HEADER + img.alloc_len)) {
+		warning("Unable to write to %s\n", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, fname)) {
+		warning("rename() failed (%s)\n", strerror(errno));
+		unlink(tmp);
 		return -1;
 	}
+	return 0;
+}
 
-	/* update last_chunk */
-	struct chunk *chunk = first_chunk;
-	while (chunk != (struct chunk *) current_end) {
-		last_chunk = chunk;
-		chunk = (struct chunk *) ((char *) chunk + chunk->size);
+/* maps a checkpoint of the same binary as the heap, before it is used */
+int remotethread_restore(const char *fname)
+{
+	if (heap_size()) {
+		warning("the heap is already in use\n");
+		return -1;
+	}
+	struct heap_file hdr;
+	struct stat st;
+	int fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || read_heap_header(fd, &hdr, &st)) {
+		warning("Unable to read %s\n", fname);
+		if (fd >= 0)
+			close(fd);
+		return -1;
 	}
+	size_t alloc_len = be64toh(hdr.call.alloc_len);
+	int ret = -1;
+	if (get_binary_hash()
+	    || be64toh(hdr.binary_hash[0]) != binary_hash[0]
+	    || be64toh(hdr.binary_hash[1]) != binary_hash[1])
+		warning("%s is a heap of another binary\n", fname);
+	else if (!(ntohl(hdr.call.flags) & CALL_RAW_HEAP)
+		 || (uint64_t) st.st_size < HEAP_FILE_HEADER + alloc_len)
+		warning("%s is not a checkpoint\n", fname);
+	else
+		ret = alloc_len ? map_heap_file(fd, &hdr) : 0;
+	close(fd);
+	return ret;
+}
+
+static int slave(int fd)
+{
+	struct reply reply;
+	memset(&reply, 0, sizeof reply);
+	reply.times[REMOTE_RECV_BINARY] = htobe64(server_times[0]);
+	reply.times[REMOTE_EXEC] = htobe64(slave_start - server_times[1]);
+
+	uint64_t begin = now_ns();
+	struct call call;
+	if (read_all(fd, &call, sizeof call))
+		return -1;
 
-	remotethread_func_t func = (remotethread_func_t) call.eip;
-	const void *param = (void *) call.param;
+	size_t alloc_len = be64toh(call.alloc_len);
+	size_t alloc_compr_len = be64toh(call.alloc_compr_len);
+	size_t param_len = be64toh(call.param_len);
+	uint32_t flags = ntohl(call.flags);
+	uint32_t num_relays = ntohl(call.num_relays);
+	reply.task = call.task;
 
-	size_t reply_len;
-	void *reply_buf = func(param, param_len, &reply_len);
+	struct image img;
+	struct relay *relays = NULL;
+	struct child *children = NULL;
+	int num_children = 0;
+	void *inline_param = NULL;
+	void *kept = NULL;
+	memset(&img, 0, sizeof img);
 
-	if (reply_buf == NULL)
+	if (reserved_len && (alloc_len > reserved_len
+			     || alloc_compr_len > compressBound(reserved_len))) {
+		warning("heap is larger than reserved\n");
 		return -1;
+	}
 
-	struct reply reply;
-	reply.status = STATUS_OK;
-	reply.reply_len = htonl(reply_len);
+	/* nothing may be allocated from the heap before it is in place */
+	if (num_relays > MAX_RELAYS) {
+		warning("too many relays\n");
+		return -1;
+	}
+	if (num_relays) {
+		relays = alloc_buffer(num_relays * sizeof *relays);
+		if (relays == NULL) {
+			warning("Out of memory\n");
+			return -1;
+		}
+		if (read_all(fd, relays, num_relays * sizeof *relays))
+			goto err;
+	}
+
+	/* a published heap is read from its file, unless a host has it */
+	if (heap_file) {
+		if (!heap_loaded && load_heap_file())
+			goto err;
+	} else if (read_image(fd, &img, alloc_len, alloc_compr_len, flags))
+		goto err;
+	if (flags & CALL_INLINE_PARAM) {
+		inline_param = alloc_buffer(param_len);
+		if (inline_param == NULL) {
+			warning("Out of memory\n");
+			goto err;
+		}
+		if (read_all(fd, inline_param, param_len))
+			goto err;
+	}
+	reply.times[REMOTE_RECV_HEAP] = htobe64(now_ns() - begin);
+
+	/* pass the image down the tree before doing anything with it */
+	children = split_children(relays, num_relays, &num_children);
+	if (children == NULL)
+		goto err;
+	start_children(children, num_children, 0, &img, NULL, 0);
+
+	/* the chained tasks get the image as we received it */
+	int i, chained = 0;
+	for (i = 0; i < num_children; ++i)
+		chained |= is_chained(&children[i]);
+	if (chained && img.compr == NULL) {
+		kept = alloc_buffer(alloc_compr_len);
+		if (kept)
+			memcpy(kept, img.data, alloc_compr_len);
+		img.data = kept;
+	}
+
+	begin = now_ns();
+	int ret = 0;
+	if (img.compr) {
+		ret = inflate_heap(img.compr, alloc_compr_len, alloc_len);
+		if (!chained) {
+			free_buffer(img.compr);
+			img.compr = NULL;
+		}
+	}
+
+	void *reply_buf = NULL;
+	size_t reply_len = 0;
+	if (ret == 0) {
+		if (heap_file == NULL)
+			place_image(alloc_len, NULL);
+		reply.times[REMOTE_INFLATE] = htobe64(now_ns() - begin);
+
+		const void *param = (void *) be64toh(call.param);
+		if (inline_param) {
+			void *buf = remotethread_malloc(param_len, NULL);
+			if (buf)
+				memcpy(buf, inline_param, param_len);
+			param = buf;
+		}
+
+		/* func may change the parameters of the chained tasks */
+		for (i = 0; i < num_children; ++i) {
+			struct child *c = &children[i];
+			size_t len = be64toh(c->relays[0].param_len);
+			if (!is_chained(c) || img.data == NULL)
+				continue;
+			c->param = alloc_buffer(len);
+			if (c->param)
+				memcpy(c->param,
+				       (void *) be64toh(c->relays[0].param),
+				       len);
+		}
+
+		if (param && (flags & CALL_WORKER)) {
+			remotethread_map_t map = (remotethread_map_t)
+				(be64toh(call.eip) + load_bias());
+			ret = run_worker(fd, ntohl(call.task), map, param,
+					 param_len);
+			goto out;
+		}
+
+		remotethread_func_t func = (remotethread_func_t)
+			(be64toh(call.eip) + load_bias());
+		begin = now_ns();
+		if (param)
+			reply_buf = func(param, param_len, &reply_len);
+		reply.times[REMOTE_FUNC] = htobe64(now_ns() - begin);
+	}
+
+	/* a failure here is only ours, the subtrees still answer */
+	if (reply_buf == NULL) {
+		ret = send_error(fd, ntohl(call.task));
+	} else {
+		/* the reply of a chained task goes on instead of up */
+		if (chained) {
+			start_children(children, num_children, 1, &img,
+				       reply_buf, reply_len);
+			reply_len = 0;
+		}
+		reply.status = STATUS_OK;
+		reply.reply_len = htobe64(reply_len);
 
-	if (write_all(fd, &reply, sizeof reply)) {
+		/* stored first, the client may go away once it has the reply */
+		if (cache_file && !chained)
+			store_reply(reply_buf, reply_len);
+		struct iovec iov[2];
+		iov[0].iov_base = &reply;
+		iov[0].iov_len = sizeof reply;
+		iov[1].iov_base = reply_buf;
+		iov[1].iov_len = reply_len;
+		ret = writev_all(fd, iov, 2);
 		free(reply_buf);
+	}
+ out:
+	if (img.compr)
+		free_buffer(img.compr);
+	if (kept)
+		free_buffer(kept);
+	if (inline_param)
+		free_buffer(inline_param);
+	if (ret == 0)
+		ret = relay_replies(fd, children, num_children);
+	free_children(children, num_children);
+	if (relays)
+		free_buffer(relays);
+	return ret;
+
+ err:
+	if (img.compr)
+		free_buffer(img.compr);
+	if (inline_param)
+		free_buffer(inline_param);
+	if (relays)
+		free_buffer(relays);
+	return -1;
+}
+
+/*
+ * Keeps a published heap in place and runs each call passed by the server
+ * in a child forked from us, so that the tasks share the pages of the
+ * heap until they write to them. At most one task per CPU runs at once,
+ * the rest wait in the backlog. Exits once idle, or once the heap is
+ * unpublished and its calls are done.
+ */
+static void host_sigchld(int sig)
+{
+	UNUSED(sig);
+}
+
+static int host(int listen_fd)
+{
+	if (load_heap_file())
+		return -1;
+	long max_tasks = sysconf(_SC_NPROCESSORS_ONLN);
+	struct call_proc *procs = alloc_buffer(max_tasks * sizeof *procs);
+	struct pollfd *pfd = alloc_buffer((1 + max_tasks) * sizeof *pfd);
+	if (procs == NULL || pfd == NULL) {
+		warning("Out of memory\n");
 		return -1;
 	}
-	if (write_all(fd, reply_buf, reply_len)) {
-		free(reply_buf);
+	int num_procs = 0;
+	int idle_ms = 0;
+
+	/* exits interrupt ppoll() only */
+	sigset_t chld, orig;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &orig);
+	signal(SIGCHLD, host_sigchld);
+
+	while (1) {
+		pid_t pid;
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+			remove_proc(procs, &num_procs, pid);
+		if (listen_fd < 0 && num_procs == 0)
+			return 0;
+
+		/* the calls passed while we are full wait in the backlog */
+		int n = 0;
+		if (listen_fd >= 0 && num_procs < max_tasks) {
+			pfd[0].fd = listen_fd;
+			pfd[0].events = POLLIN;
+			pfd[0].revents = 0;
+			n = 1;
+		}
+		watch_procs(pfd, n, procs, num_procs);
+		struct timespec ts;
+		ts.tv_sec = HOST_CHECK_MS / 1000;
+		ts.tv_nsec = HOST_CHECK_MS % 1000 * 1000000L;
+		int ret = ppoll(pfd, n + num_procs, &ts, &orig);
+		if (ret < 0 && errno != EINTR) {
+			warning("ppoll() failed (%s)\n", strerror(errno));
+			return -1;
+		}
+		if (ret < 0)
+			continue;
+		kill_abandoned(pfd + n, procs, num_procs);
+		if (ret == 0) {
+			idle_ms += HOST_CHECK_MS;
+			if (num_procs == 0 && (idle_ms >= HOST_IDLE_MS
+					       || access(heap_file, F_OK)))
+				return 0;
+			continue;
+		}
+		if (n == 0 || !(pfd[0].revents & POLLIN))
+			continue;
+		idle_ms = 0;
+
+		int sock = accept(listen_fd, NULL, NULL);
+		if (sock < 0)
+			continue;
+		/* the server connects once it has removed the heap */
+		if (access(heap_file, F_OK)) {
+			close(listen_fd);
+			listen_fd = -1;
+			close(sock);
+			continue;
+		}
+		/*
+		 * The server sends the client with the time it passed it, and
+		 * holds the memory of the call until the socket is closed.
+		 */
+		uint64_t passed[2];
+		int fd = recv_fd(sock, passed, sizeof passed);
+		if (fd < 0) {
+			close(sock);
+			continue;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			int i;
+			sigprocmask(SIG_SETMASK, &orig, NULL);
+			signal(SIGCHLD, SIG_DFL);
+			close(listen_fd);
+			for (i = 0; i < num_procs; ++i)
+				close(procs[i].fd);
+			slave_start = now_ns();
+			server_times[0] = 0;
+			server_times[1] = passed[0];
+			slave_deadline = passed[1];
+			set_deadline(slave_deadline);
+			if (slave(fd))
+				send_error(fd, TASK_NONE);
+			close(fd);
+			exit(0);
+		}
+		/* the child keeps the socket until it exits */
+		close(sock);
+		if (pid > 0) {
+			procs[num_procs].pid = pid;
+			procs[num_procs].fd = fd;
+			procs[num_procs].killed = 0;
+			num_procs++;
+		} else {
+			send_error(fd, TASK_NONE);
+			close(fd);
+		}
+	}
+}
+
+/* parses an address of form ip[:port] */
+static int parse_server(const char *val)
+{
+	if (val == NULL) {
+		warning("missing server address\n");
+		return -1;
+	}
+	if (num_servers >= MAX_SERVERS) {
+		warning("too many servers\n");
+		return -1;
+	}
+	char addr[64];
+	int port = DEFAULT_PORT;
+	strncpy(addr, val, sizeof addr - 1);
+	addr[sizeof addr - 1] = 0;
+	char *colon = strchr(addr, ':');
+	if (colon) {
+		*colon = 0;
+		port = atoi(colon + 1);
+	}
+
+	struct sockaddr_in *sin = &servers[num_servers];
+	memset(sin, 0, sizeof *sin);
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &sin->sin_addr) < 1 || port <= 0
+	    || port > 65535) {
+		warning("invalid address: %s\n", val);
+		return -1;
+	}
+	num_servers++;
+	return 0;
+}
+
+static int parse_hugepages(const char *val)
+{
+	if (val == NULL) {
+		warning("missing huge page mode\n");
+		return -1;
+	}
+	if (strcmp(val, "none") == 0)
+		hugepages = HUGEPAGES_NONE;
+	else if (strcmp(val, "transparent") == 0)
+		hugepages = HUGEPAGES_TRANSPARENT;
+	else if (strcmp(val, "explicit") == 0)
+		hugepages = HUGEPAGES_EXPLICIT;
+	else {
+		warning("invalid huge page mode: %s\n", val);
 		return -1;
 	}
-	free(reply_buf);
 	return 0;
 }
 
@@ -595,31 +4038,113 @@ int init_remotethread(int *argc, char ***argv)
 {
 	my_binary = (*argv)[0];
 
-	if (*argc >= 3 && strcmp((*argv)[1], SLAVE_ARG) == 0) {
-		/* we are a slave process */
-		unlink(my_binary);
+	if (*argc >= 3 && (strcmp((*argv)[1], SLAVE_ARG) == 0
+			   || strcmp((*argv)[1], HOST_ARG) == 0)) {
+		/* we are a slave process, and may relay our binary */
+		slave_start = now_ns();
+		signal(SIGPIPE, SIG_IGN);
 
-		int fd = atoi((*argv)[2]);
-		if (slave(fd)) {
-			struct reply reply;
-			reply.status = STATUS_ERROR;
-			reply.reply_len = 0;
-			write_all(fd, &reply, sizeof reply);
+		int i;
+		for (i = 3; i + 1 < *argc; i += 2) {
+			const char *val = (*argv)[i + 1];
+			if (strcmp((*argv)[i], HUGEPAGES_ARG) == 0)
+				parse_hugepages(val);
+			else if (strcmp((*argv)[i], TIMES_ARG) == 0)
+				sscanf(val, "%" SCNu64 ":%" SCNu64,
+				       &server_times[0], &server_times[1]);
+			else if (strcmp((*argv)[i], CACHE_ARG) == 0)
+				cache_file = val;
+			else if (strcmp((*argv)[i], HEAP_ARG) == 0)
+				heap_file = val;
+			else if (strcmp((*argv)[i], RESERVED_ARG) == 0)
+				sscanf(val, "%" SCNu64, &reserved_len);
+			else if (strcmp((*argv)[i], DEADLINE_ARG) == 0)
+				sscanf(val, "%" SCNu64, &slave_deadline);
 		}
+
+		/* the binary of a published heap is kept by the server */
+		binary_fd = open(my_binary, O_RDONLY | O_CLOEXEC);
+		if (heap_file == NULL)
+			unlink(my_binary);
+
+		int fd = atoi((*argv)[2]);
+		if (strcmp((*argv)[1], HOST_ARG) == 0)
+			exit(heap_file && host(fd) == 0 ? 0 : 1);
+		if (slave(fd))
+			send_error(fd, TASK_NONE);
 		close(fd);
 		exit(0);
 	}
 
+	/* the binary is sent straight from the file */
+	if (binary_fd < 0)
+		binary_fd = open(my_binary, O_RDONLY | O_CLOEXEC);
+
 	int i, j = 1;
+	uint64_t num;
 	for (i = 1; i < *argc; ++i) {
 		const char *arg = (*argv)[i];
 		const char *val = (*argv)[i + 1];
 		if (strcmp(arg, "--remotethread") == 0) {
-			if (inet_pton(AF_INET, val, &servers[num_servers++])
-			    < 1) {
-				warning("invalid address: %s\n", val);
+			if (parse_server(val))
+				return -1;
+			i++;
+		} else if (strcmp(arg, HUGEPAGES_ARG) == 0) {
+			if (parse_hugepages(val))
+				return -1;
+			i++;
+		} else if (strcmp(arg, "--remotethread-compress") == 0) {
+			if (parse_number(val, 9, &num)) {
+				warning("invalid compression level: %s\n", val);
+				return -1;
+			}
+			compress_level = num;
+			i++;
+		} else if (strcmp(arg, "--remotethread-workers") == 0) {
+			if (parse_number(val, MAX_WORKERS, &num) || num < 1) {
+				warning("invalid number of workers: %s\n", val);
+				return -1;
+			}
+			workers_per_server = num;
+			i++;
+		} else if (strcmp(arg, "--remotethread-cache") == 0) {
+			if (parse_number(val, SIZE_MAX >> 20, &num)) {
+				warning("invalid cache size: %s\n", val);
+				return -1;
+			}
+			caching = 1;
+			cache_limit = num << 20;
+			i++;
+		} else if (strcmp(arg, "--remotethread-retries") == 0) {
+			if (parse_number(val, INT_MAX, &num)) {
+				warning("invalid number of retries: %s\n", val);
+				return -1;
+			}
+			max_retries = num;
+			i++;
+		} else if (strcmp(arg, "--remotethread-timeout") == 0) {
+			if (parse_number(val, UINT_MAX, &num)) {
+				warning("invalid timeout: %s\n", val);
+				return -1;
+			}
+			remotethread_set_timeout(num);
+			i++;
+		} else if (strcmp(arg, "--remotethread-restore") == 0) {
+			if (val == NULL) {
+				warning("missing checkpoint file name\n");
+				return -1;
+			}
+			if (remotethread_restore(val))
+				return -1;
+			i++;
+		} else if (strcmp(arg, "--remotethread-trace") == 0) {
+			if (val == NULL) {
+				warning("missing trace file name\n");
 				return -1;
 			}
+			if (trace_fname == NULL)
+				atexit(write_trace_at_exit);
+			trace_fname = val;
 			i++;
 		} else {
 			(*argv)[j++] = (*argv)[i];
@@ -0,0 +1,69 @@
+#define _GNU_SOURCE
+#include "procs.h"
+#include "utils.h"
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+
+/* polls for the clients of procs going away, after the first n */
+void watch_procs(struct pollfd *pfd, int n, const struct call_proc *procs,
+		 int num)
+{
+	int i;
+	for (i = 0; i < num; ++i) {
+		pfd[n + i].fd = procs[i].killed ? -1 : procs[i].fd;
+		pfd[n + i].events = POLLRDHUP;
+		pfd[n + i].revents = 0;
+	}
+}
+
+/*
+ * Kills the processes whose clients have closed the connection, which is
+ * closed here once they have exited.
+ */
+void kill_abandoned(const struct pollfd *pfd, struct call_proc *procs,
+		    int num)
+{
+	int i;
+	for (i = 0; i < num; ++i) {
+		struct call_proc *p = &procs[i];
+		if (!p->killed
+		    && (pfd[i].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+			kill(p->pid, SIGKILL);
+			p->killed = 1;
+		}
+	}
+}
+
+/* forgets a process that has exited */
+void remove_proc(struct call_proc *procs, int *num, pid_t pid)
+{
+	int i;
+	for (i = 0; i < *num; ++i) {
+		if (procs[i].pid != pid)
+			continue;
+		close(procs[i].fd);
+		procs[i] = procs[--*num];
+		return;
+	}
+}
+
+/*
+ * The process is killed with SIGALRM at the deadline of its call, the
+ * timer survives exec().
+ */
+void set_deadline(uint64_t deadline)
+{
+	if (deadline == 0)
+		return;
+	uint64_t now = now_ns();
+	uint64_t left = deadline > now ? deadline - now : 1000;
+	struct itimerval it;
+	memset(&it, 0, sizeof it);
+	it.it_value.tv_sec = left / 1000000000;
+	it.it_value.tv_usec = left % 1000000000 / 1000;
+	if (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0)
+		it.it_value.tv_usec = 1;
+	signal(SIGALRM, SIG_DFL);
+	setitimer(ITIMER_REAL, &it, NULL);
+}
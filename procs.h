@@ -0,0 +1,22 @@
+#ifndef _PROCS_H
+#define _PROCS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <poll.h>
+
+/* a process running a call, killed when the client on fd goes away */
+struct call_proc {
+	pid_t pid;
+	int fd;
+	int killed;
+};
+
+void watch_procs(struct pollfd *pfd, int n, const struct call_proc *procs,
+		 int num);
+void kill_abandoned(const struct pollfd *pfd, struct call_proc *procs,
+		    int num);
+void remove_proc(struct call_proc *procs, int *num, pid_t pid);
+void set_deadline(uint64_t deadline);
+
+#endif
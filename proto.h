@@ -3,32 +3,166 @@
 
 #include <stdint.h>
 
-#define MAGIC			0x4a33de22
+/* the magic was changed when the protocol got versioned */
+#define MAGIC			0x4a33de23
+#define OLD_MAGIC		0x4a33de22
+#define PROTO_VERSION		12
 #define SLAVE_ARG		"--remotethread-slave"
+#define HUGEPAGES_ARG		"--remotethread-hugepages"
+#define TIMES_ARG		"--remotethread-times"
+#define CACHE_ARG		"--remotethread-cache-file"
+#define HEAP_ARG		"--remotethread-heap-file"
+#define HOST_ARG		"--remotethread-host"
+#define RESERVED_ARG		"--remotethread-reserved"
+#define DEADLINE_ARG		"--remotethread-deadline"
 
 #define DEFAULT_PORT		12950
 
 #define PACKED		__attribute__((packed))
 
+#define STATUS_OK	1
+#define STATUS_ERROR	2
+#define STATUS_CACHED	3 /* the reply follows the welcome */
+#define STATUS_BUSY	4 /* no memory for the call, try another server */
+
+/* the server may answer from its cache */
+#define HELLO_CACHE		0x1
+/* the binary and a call with the heap image are stored, not run */
+#define HELLO_PUBLISH		0x2
+/* the call runs on a stored binary and heap, only the call is sent */
+#define HELLO_PUBLISHED		0x4
+/* the stored binary and heap are removed */
+#define HELLO_UNPUBLISH		0x8
+/* the server answers with struct server_status instead of a call */
+#define HELLO_STATUS		0x10
+/* with HELLO_PUBLISH, the heap is a checkpoint file on the server */
+#define HELLO_CHECKPOINT	0x20
+
+/*
+ * Integers are in network byte order. The client sends hello and waits
+ * for welcome before sending the binary and the call.
+ */
 struct hello {
 	uint32_t magic;
-	uint32_t binary_len;
+	uint32_t version;
+	uint64_t binary_len;
+	uint32_t flags;
+	uint64_t key[2]; /* cache key or the id of a published heap */
+	uint64_t alloc_len; /* heap to reserve memory for */
+	uint32_t timeout_ms; /* the call is killed after this, 0 if never */
+} PACKED;
+
+struct welcome {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t status;
 } PACKED;
 
+/* the memory budget of a server and what the running calls reserve */
+struct server_status {
+	uint64_t memory;
+	uint64_t reserved;
+	uint32_t calls;
+} PACKED;
+
+/* a reply to no task in particular, all tasks of the connection failed */
+#define TASK_NONE	0xffffffff
+
+/* the heap image is not compressed */
+#define CALL_RAW_HEAP		0x1
+/* the parameters follow the heap image instead of being in it */
+#define CALL_INLINE_PARAM	0x2
+/* eip is a map function that takes ranges of work until an empty one */
+#define CALL_WORKER		0x4
+
 struct call {
-	uint32_t alloc_len;
-	uint32_t alloc_compr_len;
-	uint32_t param_len;
+	uint64_t alloc_len;
+	uint64_t alloc_compr_len;
+	uint64_t param_len;
 	uint64_t eip; /* memory address */
 	uint64_t param; /* memory address */
+	uint32_t flags;
+	uint32_t task;
+	uint32_t num_relays; /* struct relay entries follow the call */
 } PACKED;
 
-#define STATUS_OK	1
-#define STATUS_ERROR	2
+/*
+ * A heap file, as the servers keep published heaps and as the client
+ * checkpoints its heap: this header padded to HEAP_FILE_HEADER bytes and
+ * the image of the stored call. A raw image is followed by zeros up to
+ * alloc_len, so that it can be mapped in place.
+ */
+#define HEAP_MAGIC		0x4a33de24
+#define HEAP_FILE_HEADER	4096
+
+struct heap_file {
+	uint32_t magic;
+	struct call call;
+	uint64_t binary_hash[2]; /* of the client binary, 0 if unknown */
+	uint64_t last_chunk; /* memory addresses, 0 if unknown */
+	uint64_t alloc_chunk;
+} PACKED;
+
+/* follows the binary of HELLO_CHECKPOINT, and is followed by the path */
+struct checkpoint {
+	uint32_t path_len;
+} PACKED;
+
+/* started after the parent task, with its reply appended to the param */
+#define RELAY_CHAINED	0x1
+
+/*
+ * A task that the slave starts on another server, followed by the tasks
+ * that that one starts in turn (preorder). The heap image follows the
+ * relays.
+ */
+struct relay {
+	uint32_t addr;
+	uint16_t port;
+	uint32_t task;
+	uint32_t flags;
+	uint32_t num_below; /* entries of its subtree */
+	uint64_t eip; /* memory address */
+	uint64_t param; /* memory address */
+	uint64_t param_len;
+} PACKED;
+
+/* the parameters of a worker, followed by the argument of the functions */
+struct worker_param {
+	uint64_t reduce; /* memory address, 0 if none */
+	uint64_t item_size; /* 0 if the items are not sent */
+} PACKED;
+
+/*
+ * A range of items for a worker, followed by the items if they are sent.
+ * The worker answers with a reply for each range, which is empty if it
+ * reduces the results. An empty range with merge_len set is followed by
+ * the result of another worker, which the worker reduces into its own
+ * and acknowledges with an empty reply. An empty range without ends the
+ * work and brings the reduced result.
+ */
+struct work {
+	uint64_t begin;
+	uint64_t end;
+	uint64_t merge_len;
+} PACKED;
+
+/* phases measured by the server and the slave, same order as in the API */
+enum {
+	REMOTE_RECV_BINARY,
+	REMOTE_EXEC,
+	REMOTE_RECV_HEAP,
+	REMOTE_INFLATE,
+	REMOTE_FUNC,
+	NUM_REMOTE_PHASES,
+};
 
+/* the replies of a subtree come in any order */
 struct reply {
 	uint8_t status;
-	uint32_t reply_len;
+	uint32_t task;
+	uint64_t reply_len;
+	uint64_t times[NUM_REMOTE_PHASES]; /* nanoseconds */
 } PACKED;
 
 #endif
@@ -1,72 +1,928 @@
 /*
  * remotethread server
  */
+#define _GNU_SOURCE
 #include "utils.h"
+#include "procs.h"
 #include "proto.h"
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <endian.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/* attempts to reach the host of a published heap, 10 ms apart */
+#define HOST_TRIES	100
+/* calls holding memory at once, the others are answered busy */
+#define MAX_RESERVATIONS	1024
+#define CACHE_BUCKETS		1024
+
+/* memory reserved by a call until its process exits */
+struct reservation {
+	pid_t pid;
+	uint64_t bytes;
+};
+
+/* the cached reply a process has sent, or stores before it exits */
+struct cache_use {
+	pid_t pid;
+	uint64_t key[2];
+};
+
+/* shared by the server and the processes it forks */
+struct budget {
+	uint64_t reserved;
+	struct reservation slots[MAX_RESERVATIONS];
+	struct cache_use uses[MAX_RESERVATIONS];
+};
+
+/* a reply in the cache directory, most recently used first */
+struct cache_file {
+	uint64_t key[2];
+	uint64_t size;
+	struct cache_file *chain;
+	struct cache_file *prev;
+	struct cache_file *next;
+};
 
 static int quit = 0;
+static int port = DEFAULT_PORT;
+static const char *hugepages = NULL;
+static const char *cache_dir = NULL;
+static uint64_t cache_limit = 0;
+static uint64_t cache_total = 0;
+static struct cache_file *cache_buckets[CACHE_BUCKETS];
+static struct cache_file *cache_head = NULL;
+static struct cache_file *cache_tail = NULL;
+static const char *heap_dir = NULL;
+static struct budget *budget = NULL;
+static uint64_t memory_limit = 0;
+static int queue_ms = 1000;
+static struct call_proc *procs = NULL;
+static struct pollfd *pfd = NULL;	/* the listening socket, then procs */
+static int num_procs = 0;
+static int max_procs = 0;
 
-int write_file(const char *fname, const void *buf, size_t len)
+/*
+ * Reserves memory for a call of this process, if it fits. A process may
+ * add to its reservation as it learns more about the call.
+ */
+static int reserve(uint64_t bytes)
 {
-	FILE *f = fopen(fname, "wb");
-	if (f == NULL) {
-		warning("Unable to write to %s\n", fname);
+	uint64_t cur = __atomic_load_n(&budget->reserved, __ATOMIC_RELAXED);
+	do {
+		if (cur + bytes > memory_limit)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&budget->reserved, &cur,
+					      cur + bytes, 0, __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+	int i;
+	pid_t pid = getpid();
+	for (i = 0; i < MAX_RESERVATIONS; ++i) {
+		struct reservation *r = &budget->slots[i];
+		if (__atomic_load_n(&r->pid, __ATOMIC_RELAXED) == pid) {
+			r->bytes += bytes;
+			return 0;
+		}
+	}
+	for (i = 0; i < MAX_RESERVATIONS; ++i) {
+		struct reservation *r = &budget->slots[i];
+		pid_t none = 0;
+		if (__atomic_compare_exchange_n(&r->pid, &none, pid, 0,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED)) {
+			r->bytes = bytes;
+			return 0;
+		}
+	}
+	__atomic_sub_fetch(&budget->reserved, bytes, __ATOMIC_SEQ_CST);
+	return -1;
+}
+
+/* called when a process has exited */
+static void release(pid_t pid)
+{
+	int i;
+	for (i = 0; i < MAX_RESERVATIONS; ++i) {
+		struct reservation *r = &budget->slots[i];
+		if (r->pid != pid)
+			continue;
+		__atomic_sub_fetch(&budget->reserved, r->bytes,
+				   __ATOMIC_SEQ_CST);
+		__atomic_store_n(&r->pid, 0, __ATOMIC_SEQ_CST);
+		return;
+	}
+}
+
+/* a call that does not fit waits in the queue for a while */
+static int admit(uint64_t bytes)
+{
+	if (bytes > memory_limit)
 		return -1;
+	int waited;
+	for (waited = 0; reserve(bytes); waited += 10) {
+		if (waited >= queue_ms)
+			return -1;
+		usleep(10000);
 	}
-	fwrite(buf, 1, len, f);
-	fclose(f);
 	return 0;
 }
 
-void process(int fd)
+static int send_status(int fd)
 {
-	struct hello hello;
-	if (read_all(fd, &hello, sizeof hello))
-		return;
+	struct server_status status;
+	int i, calls = 0;
+	for (i = 0; i < MAX_RESERVATIONS; ++i)
+		calls += __atomic_load_n(&budget->slots[i].pid,
+					 __ATOMIC_RELAXED) != 0;
+	status.memory = htobe64(memory_limit);
+	status.reserved = htobe64(__atomic_load_n(&budget->reserved,
+						  __ATOMIC_RELAXED));
+	status.calls = htonl(calls);
+	return write_all(fd, &status, sizeof status);
+}
 
-	if (ntohl(hello.magic) != MAGIC) {
-		warning("Invalid magic\n");
-		return;
+static void cache_fname(char *buf, size_t size, const uint64_t *key)
+{
+	snprintf(buf, size, "%s/%016" PRIx64 "%016" PRIx64, cache_dir, key[0],
+		 key[1]);
+}
+
+static void cache_unlink(struct cache_file *f)
+{
+	if (f->prev)
+		f->prev->next = f->next;
+	else
+		cache_head = f->next;
+	if (f->next)
+		f->next->prev = f->prev;
+	else
+		cache_tail = f->prev;
+}
+
+static void cache_push(struct cache_file *f)
+{
+	f->prev = NULL;
+	f->next = cache_head;
+	if (cache_head)
+		cache_head->prev = f;
+	else
+		cache_tail = f;
+	cache_head = f;
+}
+
+static void cache_remove(struct cache_file *f)
+{
+	struct cache_file **p = &cache_buckets[f->key[0] % CACHE_BUCKETS];
+	while (*p != f)
+		p = &(*p)->chain;
+	*p = f->chain;
+	cache_unlink(f);
+	cache_total -= f->size;
+	free(f);
+}
+
+/* a reply that has been used or stored becomes the most recent */
+static void cache_touch(const uint64_t *key, uint64_t size)
+{
+	struct cache_file *f = cache_buckets[key[0] % CACHE_BUCKETS];
+	while (f && (f->key[0] != key[0] || f->key[1] != key[1]))
+		f = f->chain;
+	if (f) {
+		cache_unlink(f);
+		cache_total -= f->size;
+	} else {
+		f = malloc(sizeof *f);
+		if (f == NULL)
+			return;
+		memcpy(f->key, key, sizeof f->key);
+		f->chain = cache_buckets[key[0] % CACHE_BUCKETS];
+		cache_buckets[key[0] % CACHE_BUCKETS] = f;
+	}
+	f->size = size;
+	cache_total += size;
+	cache_push(f);
+}
+
+/* removes the least recently used replies until the cache fits */
+static void evict_cache(void)
+{
+	while (cache_total > cache_limit && cache_tail) {
+		char fname[256];
+		cache_fname(fname, sizeof fname, cache_tail->key);
+		unlink(fname);
+		cache_remove(cache_tail);
 	}
+}
+
+/* called by the process of a call that may use the cache */
+static void note_cache_use(const uint64_t *key)
+{
+	int i;
+	pid_t pid = getpid();
+	for (i = 0; i < MAX_RESERVATIONS; ++i) {
+		struct cache_use *u = &budget->uses[i];
+		pid_t none = 0;
+		if (__atomic_compare_exchange_n(&u->pid, &none, pid, 0,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED)) {
+			memcpy(u->key, key, sizeof u->key);
+			return;
+		}
+	}
+}
 
-	size_t binary_len = ntohl(hello.binary_len);
-	void *binary = malloc(binary_len);
-	if (binary == NULL) {
-		warning("Unable to allocate binary\n");
+/* called when a process has exited, its reply is in place by then */
+static void cache_used(pid_t pid)
+{
+	int i;
+	for (i = 0; i < MAX_RESERVATIONS; ++i) {
+		struct cache_use *u = &budget->uses[i];
+		if (u->pid != pid)
+			continue;
+		char fname[256];
+		struct stat stbuf;
+		cache_fname(fname, sizeof fname, u->key);
+		if (stat(fname, &stbuf) == 0)
+			cache_touch(u->key, stbuf.st_size);
+		__atomic_store_n(&u->pid, 0, __ATOMIC_SEQ_CST);
+		evict_cache();
 		return;
 	}
-	if (read_all(fd, binary, binary_len)) {
-		free(binary);
+}
+
+/* a file found in the cache directory at startup */
+struct found_file {
+	uint64_t key[2];
+	struct timespec mtime;
+	uint64_t size;
+};
+
+static int compare_mtime(const void *a, const void *b)
+{
+	const struct timespec *x = &((const struct found_file *) a)->mtime;
+	const struct timespec *y = &((const struct found_file *) b)->mtime;
+	if (x->tv_sec != y->tv_sec)
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/* the replies left by an earlier run, ordered by their last use */
+static void load_cache(void)
+{
+	DIR *dir = opendir(cache_dir);
+	if (dir == NULL)
 		return;
+	struct found_file *files = NULL;
+	size_t num = 0, size = 0, i;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		struct stat stbuf;
+		char hi[17], *end;
+		/* unfinished replies have the pid appended */
+		if (strlen(de->d_name) != 32
+		    || fstatat(dirfd(dir), de->d_name, &stbuf, 0))
+			continue;
+		if (num == size) {
+			size = size ? size * 2 : 64;
+			struct found_file *buf =
+				realloc(files, size * sizeof *files);
+			if (buf == NULL)
+				break;
+			files = buf;
+		}
+		memcpy(hi, de->d_name, 16);
+		hi[16] = 0;
+		files[num].key[0] = strtoull(hi, &end, 16);
+		if (*end)
+			continue;
+		files[num].key[1] = strtoull(de->d_name + 16, &end, 16);
+		if (*end)
+			continue;
+		files[num].mtime = stbuf.st_mtim;
+		files[num].size = stbuf.st_size;
+		num++;
 	}
+	closedir(dir);
 
-	char fname[64];
-	sprintf(fname, "/tmp/remotethread-%d", getpid());
-	if (write_file(fname, binary, binary_len)) {
-		free(binary);
+	qsort(files, num, sizeof *files, compare_mtime);
+	for (i = 0; i < num; ++i)
+		cache_touch(files[i].key, files[i].size);
+	free(files);
+	evict_cache();
+}
+
+/*
+ * Answers with the stored reply if there is one. The reply follows the
+ * welcome as it would follow the call.
+ */
+static int send_cached(int fd, const char *fname)
+{
+	int file_fd = open(fname, O_RDONLY);
+	if (file_fd < 0)
+		return 1;
+	struct stat stbuf;
+	if (fstat(file_fd, &stbuf)) {
+		close(file_fd);
+		return 1;
+	}
+	/* the access time may not be kept, so the mtime orders the cache */
+	utimes(fname, NULL);
+
+	struct welcome welcome;
+	welcome.magic = htonl(MAGIC);
+	welcome.version = htonl(PROTO_VERSION);
+	welcome.status = STATUS_CACHED;
+	struct reply reply;
+	memset(&reply, 0, sizeof reply);
+	reply.status = STATUS_OK;
+	reply.task = htonl(0);
+	reply.reply_len = htobe64(stbuf.st_size);
+	int ret = write_all(fd, &welcome, sizeof welcome)
+		|| write_all(fd, &reply, sizeof reply)
+		|| send_file(fd, file_fd, stbuf.st_size);
+	close(file_fd);
+	return ret ? -1 : 0;
+}
+
+/* the binary or the heap of a published heap */
+static void heap_fname(char *buf, size_t size, const struct hello *hello,
+		       const char *ext)
+{
+	snprintf(buf, size, "%s/%016" PRIx64 "%016" PRIx64 ".%s", heap_dir,
+		 be64toh(hello->key[0]), be64toh(hello->key[1]), ext);
+}
+
+/* the size of a published heap, which bounds what a call may write */
+static int published_len(const char *heap, uint64_t *len)
+{
+	struct heap_file hdr;
+	int file_fd = open(heap, O_RDONLY);
+	if (file_fd < 0)
+		return -1;
+	int ret = read_all(file_fd, &hdr, sizeof hdr);
+	close(file_fd);
+	if (ret || ntohl(hdr.magic) != HEAP_MAGIC)
+		return -1;
+	*len = be64toh(hdr.call.alloc_len);
+	return 0;
+}
+
+/*
+ * Reserves the buffers that the call about to arrive is received into:
+ * the compressed heap image, the parameters and the relays. The call is
+ * peeked at, the slave reads it.
+ */
+static int admit_call(int fd)
+{
+	struct call call;
+	size_t got = 0;
+	while (got < sizeof call) {
+		ssize_t ret = recv(fd, &call, sizeof call,
+				   MSG_PEEK | MSG_WAITALL);
+		if (ret == 0 || (ret < 0 && errno != EINTR))
+			return -1;
+		if (ret > 0)
+			got = ret;
+	}
+	uint32_t flags = ntohl(call.flags);
+	uint64_t len = (uint64_t) ntohl(call.num_relays)
+		* sizeof(struct relay);
+	if (!(flags & CALL_RAW_HEAP))
+		len += be64toh(call.alloc_compr_len);
+	if (flags & CALL_INLINE_PARAM)
+		len += be64toh(call.param_len);
+	if (be64toh(call.alloc_compr_len) > memory_limit
+	    || be64toh(call.param_len) > memory_limit || admit(len)) {
+		warning("Call does not fit in memory\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stores len bytes from the socket, extended with zeros to file_len if
+ * it is larger. The file appears when complete.
+ */
+static int store_file(int fd, const char *fname, const void *header,
+		      size_t header_len, size_t len, size_t file_len)
+{
+	char tmp[300];
+	snprintf(tmp, sizeof tmp, "%s.%d", fname, getpid());
+	int file_fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0700);
+	if (file_fd < 0) {
+		warning("Unable to write to %s\n", tmp);
+		return -1;
+	}
+	if (write_all(file_fd, header, header_len)
+	    || splice_all(fd, file_fd, len)
+	    || (file_len > header_len + len
+		&& ftruncate(file_fd, file_len))) {
+		close(file_fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(file_fd);
+	if (rename(tmp, fname)) {
+		warning("rename() failed (%s)\n", strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stores the binary and the call with the heap image that follow the
+ * welcome, the heap in the heap file format that the client checkpoints
+ * its heap in. The stored call is later used for its heap only.
+ */
+static int publish(int fd, const struct hello *hello)
+{
+	char bin[256], heap[256];
+	heap_fname(bin, sizeof bin, hello, "bin");
+	heap_fname(heap, sizeof heap, hello, "heap");
+	if (store_file(fd, bin, NULL, 0, be64toh(hello->binary_len), 0))
+		return -1;
+
+	static char header[HEAP_FILE_HEADER];
+	struct heap_file *hdr = (struct heap_file *) header;
+	if (read_all(fd, &hdr->call, sizeof hdr->call))
+		return -1;
+	uint32_t flags = ntohl(hdr->call.flags);
+	uint64_t alloc_len = be64toh(hdr->call.alloc_len);
+	uint64_t alloc_compr_len = be64toh(hdr->call.alloc_compr_len);
+	if (hdr->call.num_relays || (flags & CALL_INLINE_PARAM)
+	    || ((flags & CALL_RAW_HEAP) && alloc_compr_len > alloc_len)) {
+		warning("invalid heap\n");
+		return -1;
+	}
+	hdr->magic = htonl(HEAP_MAGIC);
+
+	/* a raw image is mapped in place from the file */
+	if (store_file(fd, heap, header, sizeof header, alloc_compr_len,
+		       (flags & CALL_RAW_HEAP) ? sizeof header + alloc_len : 0))
+		return -1;
+
+	struct reply reply;
+	memset(&reply, 0, sizeof reply);
+	reply.status = STATUS_OK;
+	reply.task = htonl(0);
+	return write_all(fd, &reply, sizeof reply);
+}
+
+/* whether a file is a checkpoint of the binary, which can be mapped */
+static int check_checkpoint(const char *path, const char *bin)
+{
+	struct heap_file hdr;
+	struct stat st;
+	int file_fd = open(path, O_RDONLY);
+	if (file_fd < 0)
+		return -1;
+	int ret = read_all(file_fd, &hdr, sizeof hdr) || fstat(file_fd, &st);
+	close(file_fd);
+	if (ret || ntohl(hdr.magic) != HEAP_MAGIC
+	    || !(ntohl(hdr.call.flags) & CALL_RAW_HEAP)
+	    || (uint64_t) st.st_size
+	       < HEAP_FILE_HEADER + be64toh(hdr.call.alloc_len))
+		return -1;
+
+	/* hashed like the client hashes its binary */
+	file_fd = open(bin, O_RDONLY);
+	if (file_fd < 0 || fstat(file_fd, &st)) {
+		if (file_fd >= 0)
+			close(file_fd);
+		return -1;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+	close(file_fd);
+	if (map == MAP_FAILED)
+		return -1;
+	uint64_t hash[2] = {0, 0};
+	hash128(map, st.st_size, hash);
+	munmap(map, st.st_size);
+	return hash[0] == be64toh(hdr.binary_hash[0])
+		&& hash[1] == be64toh(hdr.binary_hash[1]) ? 0 : -1;
+}
+
+/*
+ * Publishes a checkpoint file that the server reads itself. The binary
+ * follows the welcome and then the path of the file, and the heap is a
+ * link to the file, which must be a checkpoint of that binary.
+ */
+static int publish_checkpoint(int fd, const struct hello *hello)
+{
+	char bin[256], heap[256], tmp[300], path[PATH_MAX];
+	heap_fname(bin, sizeof bin, hello, "bin");
+	heap_fname(heap, sizeof heap, hello, "heap");
+	if (store_file(fd, bin, NULL, 0, be64toh(hello->binary_len), 0))
+		return -1;
+
+	struct checkpoint cp;
+	if (read_all(fd, &cp, sizeof cp))
+		return -1;
+	uint32_t len = ntohl(cp.path_len);
+	if (len == 0 || len >= sizeof path) {
+		warning("invalid checkpoint path\n");
+		return -1;
+	}
+	if (read_all(fd, path, len))
+		return -1;
+	path[len] = 0;
+
+	struct reply reply;
+	memset(&reply, 0, sizeof reply);
+	reply.status = STATUS_OK;
+	reply.task = htonl(0);
+	snprintf(tmp, sizeof tmp, "%s.%d", heap, getpid());
+	if (path[0] != '/' || check_checkpoint(path, bin)) {
+		warning("%s is not a checkpoint of the binary\n", path);
+		reply.status = STATUS_ERROR;
+	} else if (symlink(path, tmp) || rename(tmp, heap)) {
+		warning("Unable to link %s (%s)\n", heap, strerror(errno));
+		unlink(tmp);
+		reply.status = STATUS_ERROR;
+	}
+	if (reply.status != STATUS_OK)
+		unlink(bin);
+	return write_all(fd, &reply, sizeof reply);
+}
+
+/* starts the host of a published heap, unless another call just did */
+static void start_host(int fd, const char *bin, const char *heap,
+		       const struct sockaddr_un *sun, socklen_t len)
+{
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
 		return;
+	if (bind(listen_fd, (const struct sockaddr *) sun, len)
+	    || listen(listen_fd, 64)) {
+		close(listen_fd);
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		char buf[16];
+		sprintf(buf, "%d", listen_fd);
+		char *args[8];
+		int n = 0;
+		args[n++] = (char *) bin;
+		args[n++] = HOST_ARG;
+		args[n++] = buf;
+		args[n++] = HEAP_ARG;
+		args[n++] = (char *) heap;
+		if (hugepages) {
+			args[n++] = HUGEPAGES_ARG;
+			args[n++] = (char *) hugepages;
+		}
+		args[n] = NULL;
+		close(fd);
+		execv(bin, args);
+		warning("exec() failed (%s)\n", strerror(errno));
+		_exit(1);
 	}
-	free(binary);
+	close(listen_fd);
+}
 
-	if (chmod(fname, 0700)) {
-		warning("chmod() failed (%s)\n", strerror(errno));
-		unlink(fname);
+/* the abstract unix socket that the host of a heap listens on */
+static socklen_t host_addr(struct sockaddr_un *sun, const struct hello *hello)
+{
+	memset(sun, 0, sizeof *sun);
+	sun->sun_family = AF_UNIX;
+	snprintf(sun->sun_path + 1, sizeof sun->sun_path - 1,
+		 "remotethread-%d-%016" PRIx64 "%016" PRIx64, port,
+		 be64toh(hello->key[0]), be64toh(hello->key[1]));
+	return offsetof(struct sockaddr_un, sun_path) + 1
+		+ strlen(sun->sun_path + 1);
+}
+
+/*
+ * Calls on a published heap go to a host process that keeps the heap in
+ * place and forks a slave for each call. The host is started by the
+ * first call and listens on an abstract unix socket, which goes away
+ * with it. Returns 1 if the call should get a slave of its own instead.
+ */
+static int pass_to_host(int fd, const char *bin, const char *heap,
+			const struct hello *hello, uint64_t deadline)
+{
+	struct sockaddr_un sun;
+	socklen_t len = host_addr(&sun, hello);
+
+	int tries;
+	for (tries = 0; tries < HOST_TRIES; ++tries) {
+		int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0)
+			return 1;
+		if (connect(sock, (struct sockaddr *) &sun, len) == 0) {
+			uint64_t passed[2];
+			passed[0] = now_ns();
+			passed[1] = deadline;
+			int ret = send_fd(sock, fd, passed, sizeof passed);
+			if (ret == 0) {
+				/*
+				 * The process of the call keeps the socket
+				 * open, we keep its reservation until then.
+				 */
+				char c;
+				while (read(sock, &c, 1) < 0 && errno == EINTR)
+					;
+			}
+			close(sock);
+			return ret ? 1 : 0;
+		}
+		close(sock);
+		if (tries == 0)
+			start_host(fd, bin, heap, &sun, len);
+		else
+			usleep(10000);
+	}
+	warning("Unable to reach the host of %s\n", heap);
+	return 1;
+}
+
+/*
+ * Removes a published heap. A host that finds the heap gone when we
+ * connect stops listening and closes the connection, the calls it runs
+ * finish on their own.
+ */
+static void unpublish(const struct hello *hello, const char *heap)
+{
+	char fname[256];
+	heap_fname(fname, sizeof fname, hello, "bin");
+	unlink(heap);
+	unlink(fname);
+
+	struct sockaddr_un sun;
+	socklen_t len = host_addr(&sun, hello);
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
 		return;
+	if (connect(sock, (struct sockaddr *) &sun, len) == 0) {
+		char c;
+		while (read(sock, &c, 1) < 0 && errno == EINTR)
+			;
+	}
+	close(sock);
+}
+
+/* returns 0 if the call was answered and -1 on errors */
+int process(int fd)
+{
+	struct hello hello;
+	if (read_all(fd, &hello, sizeof hello))
+		return -1;
+	uint64_t arrived = now_ns();
+
+	/* an old client gets the error reply it expects */
+	if (ntohl(hello.magic) == OLD_MAGIC) {
+		warning("Client uses protocol version 1\n");
+		return -1;
+	}
+	if (ntohl(hello.magic) != MAGIC) {
+		warning("Invalid magic\n");
+		return -1;
+	}
+
+	/* the server accounts for the reply when the process has exited */
+	char cached[256];
+	cached[0] = 0;
+	if (cache_dir && ntohl(hello.version) == PROTO_VERSION
+	    && (ntohl(hello.flags) & HELLO_CACHE)) {
+		uint64_t key[2];
+		key[0] = be64toh(hello.key[0]);
+		key[1] = be64toh(hello.key[1]);
+		cache_fname(cached, sizeof cached, key);
+		note_cache_use(key);
+		int ret = send_cached(fd, cached);
+		if (ret <= 0)
+			return ret;
+	}
+
+	uint32_t flags = ntohl(hello.flags);
+	char heap[256];
+	heap_fname(heap, sizeof heap, &hello, "heap");
+
+	/*
+	 * Calls hold memory for the binary and the heap, and calls on a
+	 * published heap for the pages of the heap that they may write.
+	 */
+	size_t binary_len = be64toh(hello.binary_len);
+	uint64_t reserved = binary_len + be64toh(hello.alloc_len);
+	if (flags & (HELLO_PUBLISH | HELLO_PUBLISHED | HELLO_UNPUBLISH
+		     | HELLO_STATUS))
+		reserved = 0;
+
+	struct welcome welcome;
+	welcome.magic = htonl(MAGIC);
+	welcome.version = htonl(PROTO_VERSION);
+	welcome.status = STATUS_OK;
+	if (ntohl(hello.version) != PROTO_VERSION) {
+		warning("Client uses protocol version %u\n",
+			ntohl(hello.version));
+		welcome.status = STATUS_ERROR;
+	} else if ((flags & HELLO_PUBLISHED)
+		   && published_len(heap, &reserved)) {
+		warning("Unknown heap %s\n", heap);
+		welcome.status = STATUS_ERROR;
+	} else if (binary_len > memory_limit
+		   || be64toh(hello.alloc_len) > memory_limit
+		   || reserved > memory_limit) {
+		warning("Call does not fit in memory\n");
+		welcome.status = STATUS_ERROR;
+	} else if (reserved && admit(reserved)) {
+		welcome.status = STATUS_BUSY;
+	}
+	/* done before the welcome, the client hangs up once it has it */
+	if (welcome.status == STATUS_OK && (flags & HELLO_UNPUBLISH))
+		unpublish(&hello, heap);
+	if (write_all(fd, &welcome, sizeof welcome))
+		return -1;
+	if (welcome.status == STATUS_BUSY)
+		return 0;
+	if (welcome.status != STATUS_OK)
+		return -1;
+
+	char fname[256];
+	if (flags & HELLO_STATUS)
+		return send_status(fd);
+	if ((flags & HELLO_PUBLISH) && (flags & HELLO_CHECKPOINT))
+		return publish_checkpoint(fd, &hello);
+	if (flags & HELLO_PUBLISH)
+		return publish(fd, &hello);
+	if (flags & HELLO_UNPUBLISH)
+		return 0;
+
+	uint64_t begin = now_ns();
+	uint64_t deadline = 0;
+	if (hello.timeout_ms)
+		deadline = arrived + ntohl(hello.timeout_ms) * 1000000ULL;
+
+	if (flags & HELLO_PUBLISHED) {
+		/* the stored binary is not removed by the slave */
+		heap_fname(fname, sizeof fname, &hello, "bin");
+		if (admit_call(fd))
+			return -1;
+		if (pass_to_host(fd, fname, heap, &hello, deadline) == 0)
+			return 0;
+	} else {
+		/* the binary is spliced from the socket to the file */
+		sprintf(fname, "/tmp/remotethread-%d", getpid());
+		int file_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0700);
+		if (file_fd < 0) {
+			warning("Unable to write to %s\n", fname);
+			return -1;
+		}
+		if (splice_all(fd, file_fd, binary_len)) {
+			close(file_fd);
+			unlink(fname);
+			return -1;
+		}
+		close(file_fd);
+
+		if (chmod(fname, 0700)) {
+			warning("chmod() failed (%s)\n", strerror(errno));
+			unlink(fname);
+			return -1;
+		}
+		if (admit_call(fd)) {
+			unlink(fname);
+			return -1;
+		}
 	}
 
 	char buf[64];
 	sprintf(buf, "%d", fd);
-	if (execl(fname, fname, SLAVE_ARG, buf, NULL)) {
-		warning("exec() failed (%s)\n", strerror(errno));
+
+	/* the slave reports these back to the client */
+	char times[64];
+	uint64_t exec_begin = now_ns();
+	sprintf(times, "%" PRIu64 ":%" PRIu64, exec_begin - begin, exec_begin);
+
+	char *args[16];
+	int n = 0;
+	args[n++] = fname;
+	args[n++] = SLAVE_ARG;
+	args[n++] = buf;
+	args[n++] = TIMES_ARG;
+	args[n++] = times;
+	if (hugepages) {
+		args[n++] = HUGEPAGES_ARG;
+		args[n++] = (char *) hugepages;
+	}
+	if (cached[0]) {
+		args[n++] = CACHE_ARG;
+		args[n++] = cached;
+	}
+	char alloc[32];
+	if (!(flags & HELLO_PUBLISHED)) {
+		/* the slave holds the client to its word */
+		sprintf(alloc, "%" PRIu64, be64toh(hello.alloc_len));
+		args[n++] = RESERVED_ARG;
+		args[n++] = alloc;
+	}
+	if (flags & HELLO_PUBLISHED) {
+		args[n++] = HEAP_ARG;
+		args[n++] = heap;
+	}
+	char deadline_buf[32];
+	if (deadline) {
+		/* for the tasks that the slave starts */
+		sprintf(deadline_buf, "%" PRIu64, deadline);
+		args[n++] = DEADLINE_ARG;
+		args[n++] = deadline_buf;
+		set_deadline(deadline);
+	}
+	args[n] = NULL;
+	execv(fname, args);
+	warning("exec() failed (%s)\n", strerror(errno));
+	if (!(flags & HELLO_PUBLISHED))
 		unlink(fname);
+	return -1;
+}
+
+/*
+ * Bind the server and all the slaves to the CPUs and the memory of a NUMA
+ * node. Both are inherited over fork() and exec().
+ */
+static int bind_numa_node(int node)
+{
+	char fname[64];
+	sprintf(fname, "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *f = fopen(fname, "r");
+	if (f == NULL) {
+		warning("no such NUMA node: %d\n", node);
+		return -1;
+	}
+
+	/* the list is of form "0-3,8-11" */
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	int first, last;
+	while (fscanf(f, "%d", &first) == 1) {
+		last = first;
+		int c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &last) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (; first <= last && first < CPU_SETSIZE; ++first)
+			CPU_SET(first, &cpus);
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+
+	if (sched_setaffinity(0, sizeof cpus, &cpus)) {
+		warning("sched_setaffinity() failed (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	unsigned long mask[16];
+	memset(mask, 0, sizeof mask);
+	if (node >= (int) (sizeof mask * 8)) {
+		warning("NUMA node %d is out of range\n", node);
+		return -1;
+	}
+	mask[node / (sizeof(long) * 8)] |= 1UL << (node % (sizeof(long) * 8));
+	if (syscall(SYS_set_mempolicy, MPOL_BIND, mask, sizeof mask * 8)) {
+		warning("set_mempolicy() failed (%s)\n", strerror(errno));
+		return -1;
 	}
+	return 0;
+}
+
+/* makes room for one more call */
+static int grow_procs(void)
+{
+	if (num_procs < max_procs)
+		return 0;
+	int max = max_procs ? 2 * max_procs : 64;
+	struct call_proc *new_procs = realloc(procs, max * sizeof *procs);
+	if (new_procs == NULL)
+		return -1;
+	procs = new_procs;
+	struct pollfd *new_pfd = realloc(pfd, (1 + max) * sizeof *pfd);
+	if (new_pfd == NULL)
+		return -1;
+	pfd = new_pfd;
+	max_procs = max;
+	return 0;
 }
 
 static void sigint_handler(int sig)
@@ -75,18 +931,125 @@ static void sigint_handler(int sig)
 	quit = 1;
 }
 
-int main()
+/* only interrupts ppoll(), the main loop reaps the processes */
+static void sigchld_handler(int sig)
 {
+	UNUSED(sig);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	uint64_t num;
+	for (i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *val = argv[i + 1];
+		if (val == NULL) {
+			warning("missing value for %s\n", arg);
+			return 1;
+		}
+		if (strcmp(arg, "--hugepages") == 0) {
+			if (strcmp(val, "none") && strcmp(val, "transparent")
+			    && strcmp(val, "explicit")) {
+				warning("invalid huge page mode: %s\n", val);
+				return 1;
+			}
+			hugepages = val;
+		} else if (strcmp(arg, "--port") == 0) {
+			if (parse_number(val, 65535, &num) || num == 0) {
+				warning("invalid port: %s\n", val);
+				return 1;
+			}
+			port = num;
+		} else if (strcmp(arg, "--cache-size") == 0) {
+			if (parse_number(val, UINT64_MAX >> 20, &num)) {
+				warning("invalid cache size: %s\n", val);
+				return 1;
+			}
+			cache_limit = num << 20;
+		} else if (strcmp(arg, "--cache-dir") == 0) {
+			cache_dir = val;
+		} else if (strcmp(arg, "--heap-dir") == 0) {
+			heap_dir = val;
+		} else if (strcmp(arg, "--memory") == 0) {
+			if (parse_number(val, UINT64_MAX >> 20, &num)) {
+				warning("invalid memory size: %s\n", val);
+				return 1;
+			}
+			memory_limit = num << 20;
+		} else if (strcmp(arg, "--queue-ms") == 0) {
+			if (parse_number(val, INT_MAX, &num)) {
+				warning("invalid queue time: %s\n", val);
+				return 1;
+			}
+			queue_ms = num;
+		} else if (strcmp(arg, "--numa-node") == 0) {
+			if (parse_number(val, INT_MAX, &num)) {
+				warning("invalid NUMA node: %s\n", val);
+				return 1;
+			}
+			if (bind_numa_node(num))
+				return 1;
+		} else {
+			warning("unknown option: %s\n", arg);
+			return 1;
+		}
+		i++;
+	}
+
+	/* replies are cached in files named by their key */
+	static char default_dir[64];
+	if (cache_limit && cache_dir == NULL) {
+		sprintf(default_dir, "/tmp/remotethread-cache-%d", port);
+		cache_dir = default_dir;
+	}
+	if (cache_limit == 0)
+		cache_dir = NULL;
+	if (cache_dir && mkdir(cache_dir, 0700) && errno != EEXIST) {
+		warning("Unable to create %s (%s)\n", cache_dir,
+			strerror(errno));
+		return 1;
+	}
+
+	/* the calls may reserve all of the memory by default */
+	if (memory_limit == 0) {
+		memory_limit = (uint64_t) sysconf(_SC_PHYS_PAGES)
+			* sysconf(_SC_PAGESIZE);
+	}
+	budget = mmap(NULL, sizeof *budget, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (budget == MAP_FAILED) {
+		warning("mmap() failed (%s)\n", strerror(errno));
+		return 1;
+	}
+	if (cache_dir)
+		load_cache();
+
+	/* and published heaps in files named by their id */
+	static char default_heap_dir[64];
+	if (heap_dir == NULL) {
+		sprintf(default_heap_dir, "/tmp/remotethread-heaps-%d", port);
+		heap_dir = default_heap_dir;
+	}
+	if (mkdir(heap_dir, 0700) && errno != EEXIST) {
+		warning("Unable to create %s (%s)\n", heap_dir,
+			strerror(errno));
+		return 1;
+	}
+
 	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (listen_fd < 0) {
 		warning("socket() failed (%s)\n", strerror(errno));
 		return 1;
 	}
 
+	int one = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
 	struct sockaddr_in sin;
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(DEFAULT_PORT);
+	sin.sin_port = htons(port);
 	if (bind(listen_fd, (struct sockaddr *) &sin, sizeof sin)) {
 		warning("bind() failed (%s)\n", strerror(errno));
 		return 1;
@@ -104,7 +1067,47 @@ int main()
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	/* exits only interrupt ppoll() */
+	sigset_t chld, orig;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &orig);
+
+	/*
+	 * We keep the connection of each call to notice when the client
+	 * goes away, and kill the process of the call then.
+	 */
+	if (grow_procs()) {
+		warning("Out of memory\n");
+		return 1;
+	}
 	while (quit == 0) {
+		/* the reservations of the exited processes are released */
+		pid_t pid;
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+			release(pid);
+			if (cache_dir)
+				cache_used(pid);
+			remove_proc(procs, &num_procs, pid);
+		}
+
+		pfd[0].fd = listen_fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		watch_procs(pfd, 1, procs, num_procs);
+		if (ppoll(pfd, 1 + num_procs, NULL, &orig) < 0) {
+			if (errno != EINTR)
+				warning("ppoll() failed (%s)\n", strerror(errno));
+			continue;
+		}
+		kill_abandoned(pfd + 1, procs, num_procs);
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
 		struct sockaddr_in sin;
 		socklen_t slen = sizeof sin;
 		int fd = accept(listen_fd, (struct sockaddr *) &sin, &slen);
@@ -114,23 +1117,42 @@ int main()
 			warning("accept() failed (%s)\n", strerror(errno));
 			continue;
 		}
-		pid_t pid = fork();
+		if (grow_procs()) {
+			warning("Out of memory\n");
+			close(fd);
+			continue;
+		}
+		pid = fork();
 		if (pid == 0) {
+			sigprocmask(SIG_SETMASK, &orig, NULL);
 			int i;
 			for (i = 3; i < 1000; ++i) {
 				if (i != fd)
 					close(i);
 			}
-			process(fd);
+			for (i = 0; i < num_procs; ++i)
+				close(procs[i].fd);
+			if (process(fd) == 0) {
+				close(fd);
+				_exit(0);
+			}
 			/* if we ge back an error occured */
 			struct reply reply;
+			memset(&reply, 0, sizeof reply);
 			reply.status = STATUS_ERROR;
-			reply.reply_len = 0;
+			reply.task = htonl(TASK_NONE);
 			write_all(fd, &reply, sizeof reply);
 			close(fd);
 			_exit(1);
 		}
-		close(fd);
+		if (pid > 0) {
+			procs[num_procs].pid = pid;
+			procs[num_procs].fd = fd;
+			procs[num_procs].killed = 0;
+			num_procs++;
+		} else {
+			close(fd);
+		}
 	}
 	close(listen_fd);
 	printf("terminated\n");
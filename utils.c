@@ -1,8 +1,115 @@
+#define _GNU_SOURCE
 #include "utils.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+/* larger transfers make zero-copy worth the completion handling */
+#define ZEROCOPY_MIN	(1024 * 1024)
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/*
+ * 128-bit hash of a buffer, continuing from the value in h. This is the
+ * MurmurHash3 x64 128 construction, not a cryptographic hash.
+ */
+void hash128(const void *buf, size_t len, uint64_t *h)
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	const unsigned char *p = buf;
+	uint64_t h1 = h[0], h2 = h[1];
+	uint64_t k1, k2;
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		memcpy(&k1, p + i, 8);
+		memcpy(&k2, p + i + 8, 8);
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = rotl64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = rotl64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	/* the tail is padded with zeros */
+	unsigned char tail[16];
+	memset(tail, 0, sizeof tail);
+	memcpy(tail, p + i, len - i);
+	memcpy(&k1, tail, 8);
+	memcpy(&k2, tail + 8, 8);
+	k1 *= c1;
+	k1 = rotl64(k1, 31);
+	k1 *= c2;
+	h1 ^= k1;
+	k2 *= c2;
+	k2 = rotl64(k2, 33);
+	k2 *= c1;
+	h2 ^= k2;
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	h[0] = h1;
+	h[1] = h2;
+}
+
+/* a decimal number of at most max, -1 for anything else */
+int parse_number(const char *s, uint64_t max, uint64_t *val)
+{
+	char *end;
+	if (s == NULL || !isdigit((unsigned char) *s))
+		return -1;
+	errno = 0;
+	unsigned long long num = strtoull(s, &end, 10);
+	if (errno || *end || num > max)
+		return -1;
+	*val = num;
+	return 0;
+}
+
+/* monotonic time in nanoseconds */
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 size_t bytes_available(int fd)
 {
@@ -69,3 +176,219 @@ int write_all(int fd, const void *buf, size_t len)
 	}
 	return 0;
 }
+
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t sent = writev(fd, iov, iovcnt);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			warning("writev() failed (%s)\n", strerror(errno));
+			return -1;
+		}
+		/* skip the parts that were sent */
+		while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+/* sends len bytes of a file from the beginning */
+int send_file(int fd, int file_fd, size_t len)
+{
+	off_t offset = 0;
+	while ((size_t) offset < len) {
+		ssize_t sent = sendfile(fd, file_fd, &offset, len - offset);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			warning("sendfile() failed (%s)\n", strerror(errno));
+			return -1;
+		} else if (sent == 0) {
+			warning("file was truncated\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* moves len bytes from a socket to a file through a pipe */
+int splice_all(int fd, int file_fd, size_t len)
+{
+	int p[2];
+	if (pipe(p)) {
+		warning("pipe() failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	int ret = -1;
+	while (len > 0) {
+		ssize_t got = splice(fd, NULL, p[1], NULL, len,
+				     SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (got < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			warning("splice() failed (%s)\n", strerror(errno));
+			goto out;
+		} else if (got == 0) {
+			warning("unexpected EOF\n");
+			goto out;
+		}
+		len -= got;
+		while (got > 0) {
+			ssize_t put = splice(p[0], NULL, file_fd, NULL, got,
+					     SPLICE_F_MOVE);
+			if (put < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				warning("splice() failed (%s)\n",
+					strerror(errno));
+				goto out;
+			}
+			got -= put;
+		}
+	}
+	ret = 0;
+ out:
+	close(p[0]);
+	close(p[1]);
+	return ret;
+}
+
+/* waits until the kernel has released all zero-copy sends */
+static int wait_zerocopy(int fd, uint32_t sends)
+{
+	uint32_t done = 0;
+	while (done < sends) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = 0;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			warning("poll() failed (%s)\n", strerror(errno));
+			return -1;
+		}
+
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			warning("recvmsg() failed (%s)\n", strerror(errno));
+			return -1;
+		}
+		struct cmsghdr *cm;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			const struct sock_extended_err *err =
+				(const void *) CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* a range of send calls has completed */
+			done += err->ee_data - err->ee_info + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sends a large buffer with MSG_ZEROCOPY, so that the kernel reads it
+ * directly from our pages. Returns only after the kernel is done with the
+ * buffer, as it may be modified right after.
+ */
+int send_zerocopy(int fd, const void *buf, size_t len)
+{
+	int one = 1;
+	if (len < ZEROCOPY_MIN
+	    || setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one))
+		return write_all(fd, buf, len);
+
+	size_t pos = 0;
+	uint32_t sends = 0;
+	while (pos < len) {
+		ssize_t sent = send(fd, (const char *) buf + pos, len - pos,
+				    MSG_ZEROCOPY);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/* out of option memory, copy the rest */
+				if (write_all(fd, (const char *) buf + pos,
+					      len - pos))
+					return -1;
+				break;
+			}
+			warning("send() failed (%s)\n", strerror(errno));
+			return -1;
+		}
+		pos += sent;
+		sends++;
+	}
+	return wait_zerocopy(fd, sends);
+}
+
+/* sends a file descriptor over a unix socket along with a small message */
+int send_fd(int sock, int fd, const void *buf, size_t len)
+{
+	char control[CMSG_SPACE(sizeof fd)];
+	struct iovec iov;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	memset(control, 0, sizeof control);
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof fd);
+	memcpy(CMSG_DATA(cm), &fd, sizeof fd);
+	while (sendmsg(sock, &msg, 0) < 0) {
+		if (errno == EINTR)
+			continue;
+		warning("sendmsg() failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* receives what send_fd() sent, returns the file descriptor or -1 */
+int recv_fd(int sock, void *buf, size_t len)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	ssize_t got;
+	while ((got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+		if (errno == EINTR)
+			continue;
+		warning("recvmsg() failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	if ((size_t) got != len || cm == NULL || cm->cmsg_type != SCM_RIGHTS) {
+		warning("no file descriptor received\n");
+		return -1;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cm), sizeof fd);
+	return fd;
+}
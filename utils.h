@@ -3,6 +3,9 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/types.h>
 
 #define APP_NAME	"remotethread"
 
@@ -10,9 +13,18 @@
 
 #define UNUSED(x)	((void) (x))
 
+void hash128(const void *buf, size_t len, uint64_t *h);
+uint64_t now_ns(void);
+int parse_number(const char *s, uint64_t max, uint64_t *val);
 size_t bytes_available(int fd);
 size_t read_available(int fd, void *buf, size_t len);
 int read_all(int fd, void *buf, size_t len);
 int write_all(int fd, const void *buf, size_t len);
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+int send_file(int fd, int file_fd, size_t len);
+int splice_all(int fd, int file_fd, size_t len);
+int send_zerocopy(int fd, const void *buf, size_t len);
+int send_fd(int sock, int fd, const void *buf, size_t len);
+int recv_fd(int sock, void *buf, size_t len);
 
 #endif